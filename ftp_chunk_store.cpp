@@ -0,0 +1,344 @@
+#include "ftp_chunk_store.h"
+
+#include <sstream>
+#include <filesystem>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char manifest_magic[MANIFEST_MAGIC_SIZE] = {'\0', 'F', 'T', 'P', 'C', 'A', 'S', '1'};
+
+// Normalized chunking: a stricter mask below the average size and a looser
+// one above it pulls chunk sizes towards CHUNK_AVG_SIZE.
+const uint64_t mask_small = 0x0000d9f003530000ULL;
+const uint64_t mask_large = 0x0000d90003530000ULL;
+
+struct GearTable {
+    uint64_t values[256];
+
+    GearTable() {
+        // splitmix64; the table must never change or existing chunk
+        // boundaries stop lining up with new uploads.
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t& value : values) {
+            state += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable gear;
+
+std::atomic<uint64_t> temp_counter{0};
+
+class Sha256 {
+public:
+    Sha256() {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::memcpy(state, initial, sizeof(state));
+    }
+
+    void update(const unsigned char* data, size_t size) {
+        total_bits += static_cast<uint64_t>(size) * 8;
+        while (size > 0) {
+            size_t take = std::min(size, sizeof(block) - block_size);
+            std::memcpy(block + block_size, data, take);
+            block_size += take;
+            data += take;
+            size -= take;
+            if (block_size == sizeof(block)) {
+                transform();
+                block_size = 0;
+            }
+        }
+    }
+
+    std::string hex_digest() {
+        uint64_t bits = total_bits;
+        unsigned char padding[72] = {0x80};
+        size_t padding_size = (block_size < 56 ? 56 : 120) - block_size;
+        for (int i = 0; i < 8; ++i) {
+            padding[padding_size + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(padding, padding_size + 8);
+
+        std::ostringstream out;
+        static const char digits[] = "0123456789abcdef";
+        for (uint32_t word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                out << digits[(word >> shift) & 0xf];
+            }
+        }
+        return out.str();
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void transform() {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+                   (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t choice = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + s1 + choice + k[i] + w[i];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = s0 + majority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t block_size = 0;
+    uint64_t total_bits = 0;
+};
+
+}
+
+std::string sha256_hex(const char* data, size_t size) {
+    Sha256 hasher;
+    hasher.update(reinterpret_cast<const unsigned char*>(data), size);
+    return hasher.hex_digest();
+}
+
+size_t fastcdc_cut_point(const unsigned char* data, size_t size) {
+    if (size <= CHUNK_MIN_SIZE) {
+        return size;
+    }
+
+    size_t limit = std::min<size_t>(size, CHUNK_MAX_SIZE);
+    size_t normal = std::min<size_t>(limit, CHUNK_AVG_SIZE);
+    uint64_t fingerprint = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + gear.values[data[i]];
+        if ((fingerprint & mask_small) == 0) {
+            return i;
+        }
+    }
+    for (; i < limit; ++i) {
+        fingerprint = (fingerprint << 1) + gear.values[data[i]];
+        if ((fingerprint & mask_large) == 0) {
+            return i;
+        }
+    }
+    return limit;
+}
+
+ChunkStore::ChunkStore(const std::string& root) : root(root) {
+    fs::create_directories(root);
+}
+
+std::string ChunkStore::chunk_path(const std::string& hash) const {
+    return root + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+size_t ChunkStore::sweep(const std::unordered_set<std::string>& live, uint64_t& freed_bytes) {
+    // Collect first so nothing is removed from a directory being iterated.
+    std::vector<fs::path> garbage;
+    for (const auto& directory : fs::directory_iterator(root)) {
+        std::string prefix = directory.path().filename().string();
+        if (!directory.is_directory() || prefix.size() != 2) {
+            continue;
+        }
+        for (const auto& item : fs::directory_iterator(directory.path())) {
+            if (live.count(prefix + item.path().filename().string()) == 0) {
+                garbage.push_back(item.path());
+            }
+        }
+    }
+
+    size_t removed = 0;
+    freed_bytes = 0;
+    for (const fs::path& path : garbage) {
+        std::error_code error;
+        uintmax_t size = fs::file_size(path, error);
+        if (fs::remove(path, error)) {
+            ++removed;
+            freed_bytes += size == static_cast<uintmax_t>(-1) ? 0 : size;
+        }
+    }
+    return removed;
+}
+
+bool ChunkStore::store_chunk(const char* data, size_t size, ChunkRef& chunk) {
+    chunk.hash = sha256_hex(data, size);
+    chunk.size = size;
+
+    std::string path = chunk_path(chunk.hash);
+    // A chunk of the wrong size is what a crash can leave behind; rewrite it
+    // rather than let every later upload depend on it.
+    std::error_code error;
+    uintmax_t existing_size = fs::file_size(path, error);
+    if (!error && existing_size == size) {
+        return false;
+    }
+
+    fs::create_directories(fs::path(path).parent_path());
+
+    // Write under a unique name and rename into place so concurrent uploads
+    // of the same chunk never observe a partial file.
+    std::ostringstream temp_name;
+    temp_name << path << ".tmp." << std::hash<std::thread::id>{}(std::this_thread::get_id()) << "." << temp_counter++;
+    std::string temp_path = temp_name.str();
+
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Unable to create chunk " + temp_path);
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    // The chunk must be on disk before its name is, or a crash can leave a
+    // short file under the hash.
+    bool durable = written == size && fsync(fd) == 0;
+    close(fd);
+    if (!durable) {
+        fs::remove(temp_path);
+        throw std::runtime_error("Unable to write chunk " + temp_path);
+    }
+
+    fs::rename(temp_path, path);
+    return true;
+}
+
+bool ChunkStore::is_manifest(const char* header, size_t size) {
+    return size >= MANIFEST_MAGIC_SIZE && std::memcmp(header, manifest_magic, MANIFEST_MAGIC_SIZE) == 0;
+}
+
+std::string ChunkStore::encode_manifest(const std::vector<ChunkRef>& chunks) {
+    uint64_t total = 0;
+    for (const ChunkRef& chunk : chunks) {
+        total += chunk.size;
+    }
+
+    std::ostringstream manifest;
+    manifest.write(manifest_magic, MANIFEST_MAGIC_SIZE);
+    manifest << " " << total << "\n";
+    for (const ChunkRef& chunk : chunks) {
+        manifest << chunk.hash << " " << chunk.size << "\n";
+    }
+    return manifest.str();
+}
+
+// Manifests come from files users can write, so every entry is checked
+// before its hash is turned into a path: exactly 64 lowercase hex digits and
+// a size no chunker could have exceeded.
+bool ChunkStore::decode_manifest(const std::string& content, std::vector<ChunkRef>& chunks) {
+    if (!is_manifest(content.data(), content.size())) {
+        return false;
+    }
+
+    std::istringstream manifest(content.substr(MANIFEST_MAGIC_SIZE));
+    uint64_t total = 0;
+    std::string line;
+    if (!std::getline(manifest, line) || !(std::istringstream(line) >> total)) {
+        return false;
+    }
+
+    chunks.clear();
+    uint64_t sum = 0;
+    while (std::getline(manifest, line)) {
+        std::istringstream entry(line);
+        ChunkRef chunk;
+        std::string rest;
+        if (!(entry >> chunk.hash >> chunk.size) || entry >> rest) {
+            return false;
+        }
+        if (chunk.hash.size() != 64 || chunk.hash.find_first_not_of("0123456789abcdef") != std::string::npos
+            || chunk.size == 0 || chunk.size > CHUNK_MAX_SIZE) {
+            return false;
+        }
+        sum += chunk.size;
+        chunks.push_back(chunk);
+    }
+    return sum == total;
+}
+
+ChunkUpload::ChunkUpload(ChunkStore& store) : store(store) {
+    pending.reserve(2 * CHUNK_MAX_SIZE);
+}
+
+void ChunkUpload::write(const char* data, size_t size) {
+    pending.append(data, size);
+    received_bytes += size;
+
+    // Only cut once a full maximum-size window is buffered; otherwise a
+    // boundary could depend on how the network split the stream.
+    while (pending.size() >= CHUNK_MAX_SIZE) {
+        emit_chunk(fastcdc_cut_point(reinterpret_cast<const unsigned char*>(pending.data()), pending.size()));
+    }
+}
+
+void ChunkUpload::emit_chunk(size_t length) {
+    ChunkRef chunk;
+    if (store.store_chunk(pending.data(), length, chunk)) {
+        written_bytes += length;
+    }
+    chunks.push_back(std::move(chunk));
+    pending.erase(0, length);
+}
+
+std::string ChunkUpload::finish() {
+    while (!pending.empty()) {
+        emit_chunk(fastcdc_cut_point(reinterpret_cast<const unsigned char*>(pending.data()), pending.size()));
+    }
+    return ChunkStore::encode_manifest(chunks);
+}
@@ -0,0 +1,74 @@
+#ifndef FTP_CHUNK_STORE_H
+#define FTP_CHUNK_STORE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Content-addressed storage for uploads. Files are split with FastCDC
+// (content-defined chunking over a gear rolling hash), each chunk is stored
+// once under its SHA-256, and the user's file becomes a small manifest that
+// lists the chunks. Uploading content the store already holds writes only
+// the manifest.
+
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVG_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+#define MANIFEST_MAGIC_SIZE 8
+
+struct ChunkRef {
+    std::string hash;
+    uint64_t size;
+};
+
+class ChunkStore {
+public:
+    explicit ChunkStore(const std::string& root);
+
+    // Stores data under its hash unless an identical chunk exists already.
+    // Returns true when the chunk was new and had to be written.
+    bool store_chunk(const char* data, size_t size, ChunkRef& chunk);
+    std::string chunk_path(const std::string& hash) const;
+    // Deletes every file in the store that is not a chunk named in live,
+    // including temporary files from interrupted writes. No upload may run
+    // meanwhile. Returns the number of files removed.
+    size_t sweep(const std::unordered_set<std::string>& live, uint64_t& freed_bytes);
+
+    static bool is_manifest(const char* header, size_t size);
+    static std::string encode_manifest(const std::vector<ChunkRef>& chunks);
+    // Fails unless every entry is a well-formed chunk reference and the
+    // sizes add up to the total on the first line.
+    static bool decode_manifest(const std::string& content, std::vector<ChunkRef>& chunks);
+
+private:
+    std::string root;
+};
+
+// Streams one upload into the store.
+class ChunkUpload {
+public:
+    explicit ChunkUpload(ChunkStore& store);
+
+    void write(const char* data, size_t size);
+    // Chunks whatever is still buffered and returns the manifest to save in
+    // place of the file.
+    std::string finish();
+
+    uint64_t total_bytes() const { return received_bytes; }
+    uint64_t stored_bytes() const { return written_bytes; }
+
+private:
+    void emit_chunk(size_t length);
+
+    ChunkStore& store;
+    std::string pending;
+    std::vector<ChunkRef> chunks;
+    uint64_t received_bytes = 0;
+    uint64_t written_bytes = 0;
+};
+
+size_t fastcdc_cut_point(const unsigned char* data, size_t size);
+std::string sha256_hex(const char* data, size_t size);
+
+#endif
@@ -0,0 +1,657 @@
+#include "ftp_client_lib.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace {
+
+std::runtime_error socket_error(const std::string& what) {
+    return std::runtime_error("Error: " + what + ": " + std::strerror(errno));
+}
+
+void set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        throw socket_error("Unable to make socket non-blocking");
+    }
+}
+
+// Closes a data socket if a transfer is abandoned by an exception.
+struct SocketGuard {
+    EventLoop& loop;
+    int fd;
+
+    ~SocketGuard() {
+        if (fd != -1) {
+            loop.close_fd(fd);
+        }
+    }
+
+    void release() {
+        loop.close_fd(std::exchange(fd, -1));
+    }
+};
+
+// A download in progress. It is written next to its destination and only
+// renamed over it once the server reports success; otherwise it is removed.
+struct PartialFile {
+    std::string path;
+    std::string temp_path;
+    std::ofstream stream;
+    bool committed = false;
+
+    explicit PartialFile(const std::string& path) : path(path), temp_path(path + ".part") {
+        stream.open(temp_path, std::ios::binary | std::ios::trunc);
+        if (!stream) {
+            throw std::runtime_error("Unable to create file " + temp_path);
+        }
+    }
+
+    ~PartialFile() {
+        if (!committed) {
+            stream.close();
+            std::remove(temp_path.c_str());
+        }
+    }
+
+    void commit() {
+        stream.close();
+        if (!stream || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Unable to write file " + path);
+        }
+        committed = true;
+    }
+};
+
+// The next reply on one control connection, read by a task of its own so
+// that a coroutine can wait on two connections at once.
+struct PendingReply {
+    std::string reply;
+    std::exception_ptr error;
+    bool done = false;
+    std::coroutine_handle<> waiter;
+};
+
+Task<void> read_pending(FtpClient& client, std::shared_ptr<PendingReply> pending) {
+    try {
+        pending->reply = co_await client.receive_response();
+    } catch (...) {
+        pending->error = std::current_exception();
+    }
+    pending->done = true;
+    if (std::coroutine_handle<> waiter = std::exchange(pending->waiter, nullptr)) {
+        waiter.resume();
+    }
+}
+
+std::shared_ptr<PendingReply> read_reply(FtpClient& client) {
+    auto pending = std::make_shared<PendingReply>();
+    client.event_loop().spawn(read_pending(client, pending));
+    return pending;
+}
+
+std::string take_reply(PendingReply& pending) {
+    if (pending.error) {
+        std::rethrow_exception(pending.error);
+    }
+    return std::move(pending.reply);
+}
+
+// Resumes when either pending reply (both may be null) has arrived.
+struct ReplyAwaiter {
+    PendingReply* first;
+    PendingReply* second;
+
+    bool await_ready() const noexcept {
+        return (first && first->done) || (second && second->done);
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+        for (PendingReply* pending : {first, second}) {
+            if (pending) {
+                pending->waiter = handle;
+            }
+        }
+    }
+    void await_resume() noexcept {
+        for (PendingReply* pending : {first, second}) {
+            if (pending) {
+                pending->waiter = nullptr;
+            }
+        }
+    }
+};
+
+struct FxpSide {
+    FtpClient& client;
+    std::shared_ptr<PendingReply> pending;
+    std::string final_reply;
+    int final_replies = 0;
+    bool aborted = false;
+};
+
+std::pair<std::string, int> parse_pasv_reply(const std::string& response) {
+    if (reply_code(response) != 227) {
+        throw std::runtime_error("Failed to enter passive mode: " + response);
+    }
+
+    size_t start = response.find('(') + 1;
+    size_t end = response.find(')');
+    std::string pasv_info = response.substr(start, end - start);
+
+    std::replace(pasv_info.begin(), pasv_info.end(), ',', '.');
+    std::istringstream pasv_stream(pasv_info);
+
+    int h1, h2, h3, h4, p1, p2;
+    char dot;
+    pasv_stream >> h1 >> dot >> h2 >> dot >> h3 >> dot >> h4 >> dot >> p1 >> dot >> p2;
+    if (pasv_stream.fail()) {
+        throw std::runtime_error("Malformed PASV reply: " + response);
+    }
+
+    std::string ip = std::to_string(h1) + "." + std::to_string(h2) + "." + std::to_string(h3) + "." + std::to_string(h4);
+    return {ip, (p1 << 8) + p2};
+}
+
+}
+
+struct EventLoop::Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        throw socket_error("Unable to create epoll instance");
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(epoll_fd);
+}
+
+EventLoop::Detached EventLoop::drive(EventLoop* loop, Task<void> task) {
+    ++loop->live_tasks;
+    try {
+        co_await task;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Task failed: " << e.what() << "\n";
+    }
+    --loop->live_tasks;
+}
+
+void EventLoop::spawn(Task<void> task) {
+    drive(this, std::move(task));
+}
+
+void EventLoop::add_waiter(int fd, bool for_write, std::coroutine_handle<> handle) {
+    Waiters& entry = waiters[fd];
+    if (for_write) {
+        entry.writer = handle;
+    } else {
+        entry.reader = handle;
+    }
+    update_interest(fd, entry);
+}
+
+void EventLoop::update_interest(int fd, Waiters& entry) {
+    uint32_t events = 0;
+    if (entry.reader) {
+        events |= EPOLLIN;
+    }
+    if (entry.writer) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == 0) {
+        if (entry.registered) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        waiters.erase(fd);
+        return;
+    }
+
+    struct epoll_event ev {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (entry.registered && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        throw socket_error("Unable to watch socket");
+    }
+    entry.registered = true;
+}
+
+void EventLoop::run() {
+    struct epoll_event events[64];
+
+    while (live_tasks > 0) {
+        if (waiters.empty()) {
+            std::cerr << "Error: Event loop stalled with " << live_tasks << " unfinished task(s).\n";
+            return;
+        }
+
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw socket_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            auto it = waiters.find(events[i].data.fd);
+            if (it == waiters.end()) {
+                continue;
+            }
+
+            uint32_t flags = events[i].events;
+            bool failed = flags & (EPOLLERR | EPOLLHUP);
+            std::coroutine_handle<> reader, writer;
+            if (flags & (EPOLLIN | EPOLLRDHUP) || failed) {
+                reader = std::exchange(it->second.reader, nullptr);
+            }
+            if (flags & EPOLLOUT || failed) {
+                writer = std::exchange(it->second.writer, nullptr);
+            }
+            update_interest(events[i].data.fd, it->second);
+
+            // Resuming may register or close descriptors, so the entry is not
+            // touched after this point.
+            if (reader) {
+                reader.resume();
+            }
+            if (writer) {
+                writer.resume();
+            }
+        }
+    }
+}
+
+void EventLoop::close_fd(int fd) {
+    auto it = waiters.find(fd);
+    if (it != waiters.end()) {
+        if (it->second.registered) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        waiters.erase(it);
+    }
+    close(fd);
+}
+
+Task<int> async_connect(EventLoop& loop, const std::string& ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        throw socket_error("Unable to create socket");
+    }
+    set_non_blocking(sock);
+
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        close(sock);
+        throw std::invalid_argument("Invalid IPv4 address: " + ip);
+    }
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            std::runtime_error error = socket_error("Unable to connect to " + ip + ":" + std::to_string(port));
+            close(sock);
+            throw error;
+        }
+
+        co_await loop.writable(sock);
+
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            loop.close_fd(sock);
+            errno = err;
+            throw socket_error("Unable to connect to " + ip + ":" + std::to_string(port));
+        }
+    }
+
+    co_return sock;
+}
+
+Task<int> async_accept(EventLoop& loop, int listen_socket) {
+    while (true) {
+        int sock = accept(listen_socket, nullptr, nullptr);
+        if (sock != -1) {
+            set_non_blocking(sock);
+            co_return sock;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            throw socket_error("Unable to accept data connection");
+        }
+        co_await loop.readable(listen_socket);
+    }
+}
+
+Task<size_t> async_recv(EventLoop& loop, int socket, char* buffer, size_t size) {
+    while (true) {
+        ssize_t received = recv(socket, buffer, size, 0);
+        if (received >= 0) {
+            co_return static_cast<size_t>(received);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            throw socket_error("Failed to receive data");
+        }
+        co_await loop.readable(socket);
+    }
+}
+
+Task<void> async_send_all(EventLoop& loop, int socket, const char* data, size_t size) {
+    size_t sent_total = 0;
+    while (sent_total < size) {
+        ssize_t sent = send(socket, data + sent_total, size - sent_total, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            sent_total += sent;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            throw socket_error("Failed to send data");
+        }
+        co_await loop.writable(socket);
+    }
+}
+
+int reply_code(const std::string& response) {
+    if (response.size() < 3 || !std::all_of(response.begin(), response.begin() + 3, ::isdigit)) {
+        return -1;
+    }
+    return std::stoi(response.substr(0, 3));
+}
+
+FtpClient::FtpClient(EventLoop& loop) : loop(loop) {}
+
+FtpClient::~FtpClient() {
+    if (control_socket != -1) {
+        loop.close_fd(control_socket);
+    }
+}
+
+Task<std::string> FtpClient::connect(const std::string& server_ip, int server_port) {
+    control_socket = co_await async_connect(loop, server_ip, server_port);
+    co_return co_await receive_response();
+}
+
+Task<void> FtpClient::send_command(const std::string& command) {
+    std::string cmd = command + "\r\n";
+    co_await async_send_all(loop, control_socket, cmd.c_str(), cmd.size());
+}
+
+Task<std::string> FtpClient::read_line() {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        size_t end = control_buffer.find('\n');
+        if (end != std::string::npos) {
+            std::string line = control_buffer.substr(0, end + 1);
+            control_buffer.erase(0, end + 1);
+            co_return line;
+        }
+
+        size_t received = co_await async_recv(loop, control_socket, buffer, sizeof(buffer));
+        if (received == 0) {
+            throw ConnectionClosed();
+        }
+        control_buffer.append(buffer, received);
+    }
+}
+
+Task<std::string> FtpClient::receive_response() {
+    std::string response = co_await read_line();
+    if (response.size() >= 4 && response[3] == '-') {
+        // Multi-line reply: runs until a line with the same code and a space.
+        std::string terminator = response.substr(0, 3) + " ";
+        std::string line;
+        do {
+            line = co_await read_line();
+            response += line;
+        } while (line.compare(0, 4, terminator) != 0);
+    }
+    co_return response;
+}
+
+Task<std::string> FtpClient::command(const std::string& command) {
+    co_await send_command(command);
+    co_return co_await receive_response();
+}
+
+Task<int> FtpClient::setup_active_mode() {
+    int data_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (data_socket == -1) {
+        throw socket_error("Unable to create data socket");
+    }
+    set_non_blocking(data_socket);
+
+    // Listen on the interface the control connection uses so the server can
+    // reach us even when it is not on localhost.
+    struct sockaddr_in addr {};
+    socklen_t addr_len = sizeof(addr);
+    getsockname(control_socket, (struct sockaddr*)&addr, &addr_len);
+    addr.sin_port = htons(0);
+
+    if (bind(data_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(data_socket, 1) == -1 ||
+        getsockname(data_socket, (struct sockaddr*)&addr, &addr_len) == -1) {
+        std::runtime_error error = socket_error("Unable to listen on data socket");
+        close(data_socket);
+        throw error;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, INET_ADDRSTRLEN);
+    std::replace(ip, ip + strlen(ip), '.', ',');
+    uint16_t port = ntohs(addr.sin_port);
+
+    SocketGuard listener{loop, data_socket};
+    std::string response = co_await command("PORT " + std::string(ip) + "," + std::to_string(port / 256) + "," + std::to_string(port % 256));
+    if (reply_code(response) / 100 != 2) {
+        throw std::runtime_error("Server rejected PORT: " + response);
+    }
+
+    co_return std::exchange(listener.fd, -1);
+}
+
+Task<int> FtpClient::setup_passive_mode() {
+    auto [ip, port] = parse_pasv_reply(co_await command("PASV"));
+    co_return co_await async_connect(loop, ip, port);
+}
+
+Task<std::string> FtpClient::start_transfer(const std::string& command, int& data_socket) {
+    bool is_listening = !is_passive_mode;
+    SocketGuard sock{loop, -1};
+    if (is_passive_mode) {
+        sock.fd = co_await setup_passive_mode();
+    } else {
+        sock.fd = co_await setup_active_mode();
+    }
+
+    co_await send_command(command);
+    std::string response = co_await receive_response();
+
+    // 1xx announces the transfer; a bare 2xx (as some servers send for LIST)
+    // means the data was already written. Anything else means no transfer.
+    int code = reply_code(response);
+    if (code / 100 != 1 && code / 100 != 2) {
+        data_socket = -1;
+        co_return response;
+    }
+
+    if (is_listening) {
+        data_socket = co_await async_accept(loop, sock.fd);
+    } else {
+        data_socket = std::exchange(sock.fd, -1);
+    }
+    co_return response;
+}
+
+Task<std::string> FtpClient::finish_transfer(std::string replies) {
+    if (reply_code(replies) / 100 == 1) {
+        replies += co_await receive_response();
+    }
+    co_return replies;
+}
+
+Task<std::string> FtpClient::list(std::ostream& out) {
+    SocketGuard data{loop, -1};
+    std::string replies = co_await start_transfer("LIST", data.fd);
+    if (data.fd == -1) {
+        co_return replies;
+    }
+
+    char buffer[BUFFER_SIZE];
+    size_t received;
+    while ((received = co_await async_recv(loop, data.fd, buffer, sizeof(buffer))) > 0) {
+        out.write(buffer, received);
+    }
+    data.release();
+
+    co_return co_await finish_transfer(std::move(replies));
+}
+
+Task<std::string> FtpClient::retr(const std::string& remote_name, const std::string& local_path) {
+    PartialFile file(local_path);
+
+    SocketGuard data{loop, -1};
+    std::string replies = co_await start_transfer("RETR " + remote_name, data.fd);
+    if (data.fd == -1) {
+        co_return replies;
+    }
+
+    char buffer[BUFFER_SIZE];
+    size_t received;
+    while ((received = co_await async_recv(loop, data.fd, buffer, sizeof(buffer))) > 0) {
+        file.stream.write(buffer, received);
+    }
+    data.release();
+
+    std::string final_reply = replies;
+    if (reply_code(replies) / 100 == 1) {
+        final_reply = co_await receive_response();
+        replies += final_reply;
+    }
+    if (reply_code(final_reply) / 100 == 2) {
+        file.commit();
+    }
+    co_return replies;
+}
+
+Task<std::string> FtpClient::stor(const std::string& local_path, const std::string& remote_name) {
+    std::ifstream file(local_path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Unable to open file for upload: " + local_path);
+    }
+
+    SocketGuard data{loop, -1};
+    std::string replies = co_await start_transfer("STOR " + remote_name, data.fd);
+    if (data.fd == -1) {
+        co_return replies;
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        co_await async_send_all(loop, data.fd, buffer, file.gcount());
+    }
+    data.release();
+
+    co_return co_await finish_transfer(std::move(replies));
+}
+
+Task<std::string> FtpClient::rename(const std::string& from, const std::string& to) {
+    std::string replies = co_await command("RNFR " + from);
+    if (reply_code(replies) == 350) {
+        replies += co_await command("RNTO " + to);
+    }
+    co_return replies;
+}
+
+Task<std::string> FtpClient::copy(const std::string& from, const std::string& to) {
+    std::string replies = co_await command("SITE CPFR " + from);
+    if (reply_code(replies) == 350) {
+        replies += co_await command("SITE CPTO " + to);
+    }
+    co_return replies;
+}
+
+Task<std::string> fxp_transfer(FtpClient& source, const std::string& source_name,
+                               FtpClient& destination, const std::string& destination_name) {
+    auto [ip, port] = parse_pasv_reply(co_await destination.command("PASV"));
+
+    std::string address = ip;
+    std::replace(address.begin(), address.end(), '.', ',');
+    std::string replies = co_await source.command("PORT " + address + "," + std::to_string(port / 256) + "," + std::to_string(port % 256));
+    if (reply_code(replies) / 100 != 2) {
+        // Nothing was started on the destination yet; PASV alone is harmless.
+        throw std::runtime_error("Source rejected PORT: " + replies);
+    }
+
+    // The destination must be waiting on its passive socket before the
+    // source connects, so STOR goes out first. From here both control
+    // connections are watched at once: whichever side refuses first gets
+    // the other side aborted, since a source writing into a passive socket
+    // nobody accepts (or a destination waiting for a source that never
+    // connects) would otherwise block forever.
+    co_await destination.send_command("STOR " + destination_name);
+    co_await source.send_command("RETR " + source_name);
+
+    FxpSide sides[2] = {{source}, {destination}};
+    for (FxpSide& side : sides) {
+        side.pending = read_reply(side.client);
+    }
+
+    while (sides[0].pending || sides[1].pending) {
+        co_await ReplyAwaiter{sides[0].pending.get(), sides[1].pending.get()};
+
+        for (int i = 0; i < 2; ++i) {
+            FxpSide& side = sides[i];
+            FxpSide& other = sides[1 - i];
+            if (!side.pending || !side.pending->done) {
+                continue;
+            }
+
+            std::string reply = take_reply(*side.pending);
+            side.pending.reset();
+            replies += reply;
+            int code = reply_code(reply);
+            if (code / 100 != 1) {
+                if (side.final_reply.empty()) {
+                    side.final_reply = reply;
+                    // The ABOR reply follows the final reply to the command.
+                    if (code / 100 != 2 && other.final_reply.empty() && !other.aborted) {
+                        co_await other.client.send_command("ABOR");
+                        other.aborted = true;
+                    }
+                }
+                if (++side.final_replies == (side.aborted ? 2 : 1)) {
+                    continue;
+                }
+            }
+            side.pending = read_reply(side.client);
+        }
+    }
+
+    if (reply_code(sides[0].final_reply) / 100 != 2 || reply_code(sides[1].final_reply) / 100 != 2) {
+        throw std::runtime_error("FXP transfer failed: " + replies);
+    }
+    co_return replies;
+}
@@ -0,0 +1,239 @@
+#ifndef FTP_CLIENT_LIB_H
+#define FTP_CLIENT_LIB_H
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 1024
+#endif
+
+template <typename T = void>
+class Task;
+
+namespace ftp_detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+};
+
+template <>
+struct TaskPromise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+}
+
+// Lazily started coroutine. Awaiting it runs the body and resumes the awaiter
+// when the body finishes; exceptions thrown by the body surface at co_await.
+template <typename T>
+class Task {
+public:
+    using promise_type = ftp_detail::TaskPromise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    explicit Task(handle_type handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*handle_.promise().value);
+        }
+    }
+
+private:
+    handle_type handle_;
+};
+
+namespace ftp_detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+}
+
+// Single-threaded epoll reactor. Coroutines suspend on readable()/writable()
+// and are resumed by run() once the descriptor is ready.
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    struct IoAwaiter {
+        EventLoop& loop;
+        int fd;
+        bool for_write;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop.add_waiter(fd, for_write, handle); }
+        void await_resume() const noexcept {}
+    };
+
+    IoAwaiter readable(int fd) { return IoAwaiter{*this, fd, false}; }
+    IoAwaiter writable(int fd) { return IoAwaiter{*this, fd, true}; }
+
+    // Starts a task owned by the loop. Failures are logged, not propagated.
+    void spawn(Task<void> task);
+
+    // Runs until every spawned task has finished.
+    void run();
+
+    // Drops any registration for fd and closes it.
+    void close_fd(int fd);
+
+private:
+    struct Waiters {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        bool registered = false;
+    };
+
+    struct Detached;
+
+    static Detached drive(EventLoop* loop, Task<void> task);
+    void add_waiter(int fd, bool for_write, std::coroutine_handle<> handle);
+    void update_interest(int fd, Waiters& waiters);
+
+    int epoll_fd;
+    size_t live_tasks = 0;
+    std::unordered_map<int, Waiters> waiters;
+};
+
+Task<int> async_connect(EventLoop& loop, const std::string& ip, int port);
+Task<int> async_accept(EventLoop& loop, int listen_socket);
+Task<size_t> async_recv(EventLoop& loop, int socket, char* buffer, size_t size);
+Task<void> async_send_all(EventLoop& loop, int socket, const char* data, size_t size);
+
+int reply_code(const std::string& response);
+
+// Thrown when the server drops the control connection.
+class ConnectionClosed : public std::runtime_error {
+public:
+    ConnectionClosed() : std::runtime_error("Server closed the connection.") {}
+};
+
+// One FTP control connection. All methods must be awaited from coroutines
+// running on the EventLoop passed to the constructor; any number of clients
+// can share one loop.
+class FtpClient {
+public:
+    explicit FtpClient(EventLoop& loop);
+    ~FtpClient();
+    FtpClient(const FtpClient&) = delete;
+    FtpClient& operator=(const FtpClient&) = delete;
+
+    // Connects and returns the server greeting.
+    Task<std::string> connect(const std::string& server_ip, int server_port);
+    Task<void> send_command(const std::string& command);
+    // Reads one complete (possibly multi-line) reply.
+    Task<std::string> receive_response();
+    Task<std::string> command(const std::string& command);
+
+    // Issue PORT / PASV for the next transfer. setup_active_mode returns a
+    // listening socket, setup_passive_mode an already connected data socket.
+    Task<int> setup_active_mode();
+    Task<int> setup_passive_mode();
+
+    // Each transfer returns the control replies it received.
+    Task<std::string> list(std::ostream& out);
+    // local_path is only replaced once the server reports success.
+    Task<std::string> retr(const std::string& remote_name, const std::string& local_path);
+    Task<std::string> stor(const std::string& local_path, const std::string& remote_name);
+
+    // Server-side file management; the data never crosses this connection.
+    Task<std::string> rename(const std::string& from, const std::string& to);
+    Task<std::string> copy(const std::string& from, const std::string& to);
+
+    void set_passive_mode(bool passive) { is_passive_mode = passive; }
+    bool passive_mode() const { return is_passive_mode; }
+    int control_fd() const { return control_socket; }
+    EventLoop& event_loop() { return loop; }
+
+private:
+    Task<std::string> read_line();
+    Task<std::string> start_transfer(const std::string& command, int& data_socket);
+    Task<std::string> finish_transfer(std::string replies);
+
+    EventLoop& loop;
+    int control_socket = -1;
+    bool is_passive_mode = false;
+    std::string control_buffer;
+};
+
+// Server-to-server (FXP) transfer: the destination is put in passive mode,
+// the source is pointed at it with PORT, and the file flows directly between
+// the two servers. Returns the replies from both control connections; throws
+// std::runtime_error when either server refuses or the transfer fails, after
+// sending ABOR to the other one.
+Task<std::string> fxp_transfer(FtpClient& source, const std::string& source_name,
+                               FtpClient& destination, const std::string& destination_name);
+
+#endif
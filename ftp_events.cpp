@@ -0,0 +1,200 @@
+#include "ftp_events.h"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define EVENT_POLL_MS 1000
+
+EventQueue::EventQueue(size_t capacity) : capacity(capacity) {}
+
+void EventQueue::publish(const std::string& type, const std::string& user, const std::string& path, uint64_t size, const std::string& old_path) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(FileEvent{next_seq++, type, user, path, old_path, size});
+        if (events.size() > capacity) {
+            events.pop_front();
+        }
+    }
+    published.notify_all();
+}
+
+void EventQueue::wait_from(uint64_t from, int timeout_ms, std::vector<FileEvent>& batch, uint64_t& oldest) {
+    std::unique_lock<std::mutex> lock(mutex);
+    published.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]() { return next_seq > from; });
+
+    oldest = events.empty() ? next_seq : events.front().seq;
+    uint64_t start = std::max(from, oldest);
+    batch.assign(events.begin() + (start - oldest), events.end());
+}
+
+void EventQueue::bounds(uint64_t& oldest, uint64_t& next) {
+    std::lock_guard<std::mutex> lock(mutex);
+    oldest = events.empty() ? next_seq : events.front().seq;
+    next = next_seq;
+}
+
+namespace {
+
+bool send_line(int socket, const std::string& line) {
+    size_t sent = 0;
+    while (sent < line.size()) {
+        ssize_t result = send(socket, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            return false;
+        }
+        sent += result;
+    }
+    return true;
+}
+
+bool receive_line(int socket, std::string& line) {
+    char c;
+    line.clear();
+    while (line.size() < 64) {
+        if (recv(socket, &c, 1, 0) <= 0) {
+            return false;
+        }
+        if (c == '\n') {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+// The subscriber never sends anything after FROM, so a readable socket
+// means it hung up.
+bool subscriber_gone(int socket) {
+    char c;
+    ssize_t result = recv(socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+std::string format_event(const FileEvent& event) {
+    std::string line = std::to_string(event.seq) + "\t" + event.type + "\t" + event.user + "\t" + std::to_string(event.size) + "\t" + event.path;
+    if (!event.old_path.empty()) {
+        line += "\t" + event.old_path;
+    }
+    return line + "\n";
+}
+
+void serve_subscriber(EventQueue& queue, int socket, uint64_t stream_id) {
+    uint64_t oldest, next;
+    queue.bounds(oldest, next);
+    std::string line;
+    if (!send_line(socket, "EVENTS " + std::to_string(stream_id) + " " + std::to_string(oldest) + " " + std::to_string(next) + "\n")
+        || !receive_line(socket, line)) {
+        close(socket);
+        return;
+    }
+
+    std::istringstream request(line);
+    std::string keyword;
+    uint64_t requested_stream, from;
+    if (!(request >> keyword >> requested_stream >> from) || keyword != "FROM") {
+        send_line(socket, "ERROR Expected FROM <stream_id> <seq>\n");
+        close(socket);
+        return;
+    }
+
+    // Sequence numbers from another stream (an earlier server run) say
+    // nothing about this one; start from the oldest retained event.
+    if (requested_stream != stream_id || from > next) {
+        if (!send_line(socket, "GAP " + std::to_string(oldest) + "\n")) {
+            close(socket);
+            return;
+        }
+        from = oldest;
+    }
+
+    std::vector<FileEvent> batch;
+    while (true) {
+        queue.wait_from(from, EVENT_POLL_MS, batch, oldest);
+        if (from < oldest) {
+            if (!send_line(socket, "GAP " + std::to_string(oldest) + "\n")) {
+                break;
+            }
+            from = oldest;
+        }
+
+        if (batch.empty()) {
+            if (subscriber_gone(socket)) {
+                break;
+            }
+            continue;
+        }
+
+        std::string lines;
+        for (const FileEvent& event : batch) {
+            lines += format_event(event);
+        }
+        if (!send_line(socket, lines)) {
+            break;
+        }
+        from = batch.back().seq + 1;
+    }
+    close(socket);
+}
+
+} // namespace
+
+bool event_start_socket_server(EventQueue& queue, const std::string& path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: Event socket path too long: " << path << std::endl;
+        return false;
+    }
+
+    int listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        perror("Error: Unable to create event socket");
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+
+    // Events name every user's files, so only the server's owner may subscribe.
+    mode_t old_mask = umask(0077);
+    int bound = bind(listen_socket, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(listen_socket, 16) == -1) {
+        perror("Error: Unable to listen on event socket");
+        close(listen_socket);
+        return false;
+    }
+
+    uint64_t stream_id = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::thread acceptor([&queue, listen_socket, stream_id]() {
+        while (true) {
+            int subscriber = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+            if (subscriber == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error: Unable to accept event subscriber");
+                break;
+            }
+            std::thread(serve_subscriber, std::ref(queue), subscriber, stream_id).detach();
+        }
+    });
+    acceptor.detach();
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef FTP_EVENTS_H
+#define FTP_EVENTS_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// File change notifications for consumers that would otherwise poll LIST.
+// Completed uploads, copies, renames and deletes are published into a
+// bounded in-memory queue with increasing sequence numbers and streamed to
+// subscribers on a local Unix socket.
+//
+// Stream protocol (one line per message):
+//   server: EVENTS <stream_id> <oldest_seq> <next_seq>
+//   client: FROM <stream_id> <seq>
+//   server: <seq>\t<type>\t<user>\t<size>\t<path>[\t<old_path>]   (repeated)
+// A subscriber resumes by sending the stream_id it last saw and one past the
+// last sequence number it handled; a new subscriber echoes the greeting's
+// stream_id with next_seq (or oldest_seq for the retained backlog).
+// stream_id changes on every server start. When the stream_id does not
+// match, or requested events have already been evicted, the server sends
+// "GAP <oldest_seq>" and continues from there; the subscriber should rescan
+// with LIST.
+
+#define EVENT_QUEUE_CAPACITY 4096
+
+struct FileEvent {
+    uint64_t seq;
+    std::string type; // STOR, COPY, RENAME or DELE
+    std::string user;
+    std::string path;
+    std::string old_path; // Only set for RENAME and COPY
+    uint64_t size;
+};
+
+class EventQueue {
+public:
+    explicit EventQueue(size_t capacity = EVENT_QUEUE_CAPACITY);
+
+    void publish(const std::string& type, const std::string& user, const std::string& path, uint64_t size, const std::string& old_path = "");
+
+    // Waits up to timeout_ms for events with seq >= from and copies them to
+    // events. Sets oldest to the first retained sequence number, which is
+    // larger than from when events were evicted.
+    void wait_from(uint64_t from, int timeout_ms, std::vector<FileEvent>& events, uint64_t& oldest);
+    void bounds(uint64_t& oldest, uint64_t& next);
+
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable published;
+    std::deque<FileEvent> events;
+    uint64_t next_seq = 1;
+};
+
+// Listens on a Unix socket at path and streams queue to every subscriber,
+// one thread each. Returns false when the socket cannot be created.
+bool event_start_socket_server(EventQueue& queue, const std::string& path);
+
+#endif
@@ -0,0 +1,288 @@
+#include "ftp_quota.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+QuotaIndex::QuotaIndex(const std::string& snapshot_path, const std::string& journal_path)
+    : snapshot_path(snapshot_path), journal_path(journal_path) {}
+
+QuotaIndex::~QuotaIndex() {
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+}
+
+QuotaIndex::UserUsage* QuotaIndex::find(const std::string& user) const {
+    std::shared_lock<std::shared_mutex> lock(users_mutex);
+    auto it = users.find(user);
+    return it == users.end() ? nullptr : it->second.get();
+}
+
+QuotaIndex::UserUsage& QuotaIndex::find_or_create(const std::string& user) {
+    if (UserUsage* usage = find(user)) {
+        return *usage;
+    }
+    std::unique_lock<std::shared_mutex> lock(users_mutex);
+    auto& slot = users[user];
+    if (!slot) {
+        slot = std::make_unique<UserUsage>();
+    }
+    return *slot;
+}
+
+namespace {
+
+bool parse_generation(const std::string& line, uint64_t& generation) {
+    std::istringstream header(line);
+    std::string hash, keyword;
+    return header >> hash >> keyword >> generation && hash == "#" && keyword == "generation";
+}
+
+}
+
+bool QuotaIndex::load() {
+    if (snapshot_path.empty()) {
+        return false;
+    }
+    std::ifstream snapshot(snapshot_path);
+    if (!snapshot.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    std::string user;
+    int64_t bytes;
+    uint64_t snapshot_generation = 0;
+    while (std::getline(snapshot, line)) {
+        std::istringstream record(line);
+        if (parse_generation(line, snapshot_generation)) {
+            continue;
+        }
+        if (record >> user >> bytes) {
+            UserUsage& entry = find_or_create(user);
+            entry.bytes = bytes;
+            entry.charged = bytes;
+        }
+    }
+    generation = snapshot_generation;
+
+    // A journal from an older generation was already folded into the
+    // snapshot; the server stopped before it could be truncated.
+    std::ifstream journal(journal_path);
+    uint64_t journal_generation = 0;
+    size_t replayed = 0;
+    bool first_line = true;
+    journal_current = true;
+    while (std::getline(journal, line)) {
+        // A record without its newline was cut short by a crash.
+        if (journal.eof()) {
+            break;
+        }
+        if (first_line && parse_generation(line, journal_generation)) {
+            first_line = false;
+            continue;
+        }
+        first_line = false;
+        if (journal_generation != generation) {
+            journal_current = false;
+            break;
+        }
+        std::istringstream record(line);
+        if (record >> user >> bytes) {
+            UserUsage& entry = find_or_create(user);
+            entry.bytes += bytes;
+            entry.charged += bytes;
+            ++replayed;
+        }
+    }
+
+    std::cout << "Quota index loaded: " << users.size() << " user(s), " << replayed << " journal record(s) replayed"
+              << (journal_current ? "." : ", stale journal skipped.") << std::endl;
+    return true;
+}
+
+void QuotaIndex::rebuild(const std::vector<std::string>& user_names, const std::function<uint64_t(const std::string&)>& measure_user) {
+    for (const std::string& user : user_names) {
+        UserUsage& entry = find_or_create(user);
+        entry.bytes = 0;
+        entry.charged = 0;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        size_t index;
+        while ((index = next++) < user_names.size()) {
+            const std::string& user = user_names[index];
+            try {
+                UserUsage& entry = find_or_create(user);
+                entry.bytes = measure_user(user);
+                entry.charged = entry.bytes.load();
+            } catch (const std::exception& e) {
+                std::cerr << "Error measuring usage for " << user << ": " << e.what() << std::endl;
+            }
+        }
+    };
+
+    size_t thread_count = std::min<size_t>(user_names.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "Quota index rebuilt for " << user_names.size() << " user(s) using " << thread_count << " thread(s)." << std::endl;
+}
+
+void QuotaIndex::compact() {
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    compact_locked();
+}
+
+void QuotaIndex::compact_locked() {
+    if (snapshot_path.empty()) {
+        journal_entries = 0;
+        return;
+    }
+    if (write_snapshot(generation + 1)) {
+        ++generation;
+        start_journal(true);
+    } else if (journal_fd == -1) {
+        // Keep appending to a journal that still matches the old snapshot.
+        start_journal(!journal_current);
+    } else {
+        // Try again after another QUOTA_JOURNAL_COMPACT_ENTRIES records.
+        journal_entries = 0;
+    }
+    journal_current = true;
+}
+
+bool QuotaIndex::write_snapshot(uint64_t snapshot_generation) {
+    std::string temp_path = snapshot_path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "w");
+    if (!file) {
+        perror("Error: Unable to write quota snapshot");
+        return false;
+    }
+
+    fprintf(file, "# generation %llu\n", static_cast<unsigned long long>(snapshot_generation));
+    {
+        std::shared_lock<std::shared_mutex> lock(users_mutex);
+        for (const auto& [user, usage] : users) {
+            fprintf(file, "%s %lld\n", user.c_str(), static_cast<long long>(usage->bytes.load()));
+        }
+    }
+
+    // The journal is truncated right after this, so the snapshot has to be
+    // on disk first.
+    bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+    if (!written || rename(temp_path.c_str(), snapshot_path.c_str()) == -1) {
+        perror("Error: Unable to replace quota snapshot");
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A new journal starts with the current generation; otherwise records are
+// appended to the existing one.
+void QuotaIndex::start_journal(bool truncate) {
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+    journal_fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (journal_fd == -1) {
+        perror("Error: Unable to open quota journal");
+    } else if (truncate) {
+        std::string header = "# generation " + std::to_string(generation) + "\n";
+        if (write(journal_fd, header.c_str(), header.size()) != static_cast<ssize_t>(header.size())) {
+            perror("Error: Unable to write quota journal");
+        }
+    }
+    journal_entries = 0;
+}
+
+void QuotaIndex::load_limits(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return;
+    }
+
+    std::string user;
+    uint64_t bytes;
+    while (file >> user >> bytes) {
+        find_or_create(user).limit = bytes;
+    }
+}
+
+uint64_t QuotaIndex::usage(const std::string& user) const {
+    UserUsage* entry = find(user);
+    return entry ? std::max<int64_t>(entry->bytes.load(), 0) : 0;
+}
+
+uint64_t QuotaIndex::limit(const std::string& user) const {
+    UserUsage* entry = find(user);
+    return entry ? entry->limit : 0;
+}
+
+bool QuotaIndex::allows(const std::string& user, int64_t delta) const {
+    UserUsage* entry = find(user);
+    if (!entry || entry->limit == 0) {
+        return true;
+    }
+    return entry->charged.load() + delta <= static_cast<int64_t>(entry->limit);
+}
+
+bool QuotaIndex::reserve(const std::string& user, uint64_t bytes) {
+    if (bytes == 0) {
+        return true;
+    }
+
+    UserUsage& entry = find_or_create(user);
+    int64_t current = entry.charged.load();
+    do {
+        if (entry.limit != 0 && current + static_cast<int64_t>(bytes) > static_cast<int64_t>(entry.limit)) {
+            return false;
+        }
+    } while (!entry.charged.compare_exchange_weak(current, current + static_cast<int64_t>(bytes)));
+    return true;
+}
+
+void QuotaIndex::release(const std::string& user, uint64_t bytes) {
+    if (bytes != 0) {
+        find_or_create(user).charged -= static_cast<int64_t>(bytes);
+    }
+}
+
+void QuotaIndex::apply(const std::string& user, int64_t delta, uint64_t reserved) {
+    if (delta == 0 && reserved == 0) {
+        return;
+    }
+
+    UserUsage& entry = find_or_create(user);
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    entry.bytes += delta;
+    entry.charged += delta - static_cast<int64_t>(reserved);
+    if (delta == 0) {
+        return;
+    }
+
+    if (journal_fd != -1) {
+        std::string record = user + " " + std::to_string(delta) + "\n";
+        if (write(journal_fd, record.c_str(), record.size()) != static_cast<ssize_t>(record.size())) {
+            perror("Error: Unable to append to quota journal");
+        }
+    }
+
+    if (++journal_entries >= QUOTA_JOURNAL_COMPACT_ENTRIES) {
+        compact_locked();
+    }
+}
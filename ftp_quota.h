@@ -0,0 +1,91 @@
+#ifndef FTP_QUOTA_H
+#define FTP_QUOTA_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Per-user storage usage, kept current by the commands that change it so a
+// quota check is a hash lookup instead of a directory walk.
+//
+// Persistence is a snapshot ("<user> <bytes>" per line) plus an append-only
+// journal ("<user> <delta>" per line), both starting with a
+// "# generation <n>" line. Loading replays the journal over the snapshot
+// only when the generations match; a journal left over from before the last
+// snapshot is already included in it. Without a snapshot the usage is
+// measured from the tree, one thread per user. The journal is folded into a
+// new snapshot once it grows past QUOTA_JOURNAL_COMPACT_ENTRIES records.
+// With empty paths nothing is read or written and the index only lives in
+// memory, for storage that does not survive a restart either.
+//
+// Uploads in progress reserve their bytes with reserve() as data arrives,
+// so concurrent sessions of one user cannot overrun the limit together.
+// Reservations are not persisted.
+
+#define QUOTA_JOURNAL_COMPACT_ENTRIES 10000
+
+class QuotaIndex {
+public:
+    QuotaIndex(const std::string& snapshot_path, const std::string& journal_path);
+    ~QuotaIndex();
+    QuotaIndex(const QuotaIndex&) = delete;
+    QuotaIndex& operator=(const QuotaIndex&) = delete;
+
+    // Reads the snapshot and journal. Returns false when there is no
+    // snapshot, in which case rebuild() must be called.
+    bool load();
+    // measure_user returns the bytes currently stored by one user.
+    void rebuild(const std::vector<std::string>& users, const std::function<uint64_t(const std::string&)>& measure_user);
+    // Writes a fresh snapshot and starts a new journal. If the snapshot
+    // cannot be written the current journal is kept.
+    void compact();
+
+    // Reads "<user> <bytes>" lines; users without a line are unlimited.
+    void load_limits(const std::string& path);
+
+    uint64_t usage(const std::string& user) const;
+    // 0 means unlimited.
+    uint64_t limit(const std::string& user) const;
+    // True when adding delta bytes to the user's usage, including bytes
+    // reserved by transfers in progress, stays within the limit.
+    bool allows(const std::string& user, int64_t delta) const;
+    // Atomically claims bytes against the limit. Returns false, claiming
+    // nothing, when that would exceed it.
+    bool reserve(const std::string& user, uint64_t bytes);
+    void release(const std::string& user, uint64_t bytes);
+    // Records a change in stored bytes, converting reserved bytes previously
+    // claimed for it.
+    void apply(const std::string& user, int64_t delta, uint64_t reserved = 0);
+
+private:
+    struct UserUsage {
+        std::atomic<int64_t> bytes{0};   // Stored, as recorded in the journal
+        std::atomic<int64_t> charged{0}; // bytes plus outstanding reservations
+        uint64_t limit = 0;
+    };
+
+    UserUsage* find(const std::string& user) const;
+    UserUsage& find_or_create(const std::string& user);
+    void compact_locked();
+    bool write_snapshot(uint64_t snapshot_generation);
+    void start_journal(bool truncate);
+
+    std::string snapshot_path;
+    std::string journal_path;
+    int journal_fd = -1;
+    size_t journal_entries = 0;
+    uint64_t generation = 0;
+    bool journal_current = false; // Journal on disk matches the snapshot
+    std::mutex journal_mutex;
+
+    mutable std::shared_mutex users_mutex;
+    std::unordered_map<std::string, std::unique_ptr<UserUsage>> users;
+};
+
+#endif
@@ -6,26 +6,53 @@
 #include <unistd.h>
 #include <fstream>
 #include <sstream>
-#include <filesystem>
 #include <stdexcept>
 #include <mutex>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_set>
 #include <algorithm>
 #include <iomanip>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <memory>
+
+#include "ftp_trace.h"
+#include "ftp_chunk_store.h"
+#include "ftp_vfs.h"
+#include "ftp_quota.h"
+#include "ftp_events.h"
 
 #define PORT 2121
 #define BUFFER_SIZE 1024
-
-namespace fs = std::filesystem;
+#define TRACE_FILE "ftp_trace.json"
+#define QUOTA_SNAPSHOT "quota.snapshot"
+#define QUOTA_JOURNAL "quota.journal"
+#define QUOTA_LIMITS "quotas.txt"
 
 void handle_client(int client_socket);
 void send_response(int client_socket, const std::string& response);
 std::string receive_command(int client_socket);
 bool validate_input(const std::string& input);
-void handle_data_connection(int client_socket, const std::string& command, int data_port, bool is_passive, const std::string& client_ip, int passive_socket, const std::string& user_directory);
+bool validate_filename(const std::string& filename);
+void handle_data_connection(int client_socket, const std::string& command, int data_port, bool is_passive, const std::string& client_ip, int passive_socket, const std::string& user_directory, const std::string& username);
 void handle_list_command(int data_socket, const std::string& user_directory, int client_socket);
 void handle_retr_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket);
-void handle_stor_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket);
+void handle_stor_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket, const std::string& username);
+void handle_dele_command(int client_socket, const std::string& user_directory, const std::string& filename, const std::string& username);
 void handle_help_command(int client_socket, const std::string& command);
+void handle_site_command(int client_socket, const std::string& arguments, const std::string& user_directory, std::string& copy_from, const std::string& username);
+void handle_rename_command(int client_socket, const std::string& user_directory, const std::string& rename_from, const std::string& rename_to, const std::string& username);
+bool read_manifest(VfsFile& file, const char* header, size_t header_size, std::vector<ChunkRef>& chunks);
+void send_chunks(int data_socket, const std::vector<ChunkRef>& chunks, int client_socket);
+void send_data(int data_socket, const char* data, size_t size, int client_socket);
+void wait_writable(int data_socket, int client_socket);
+uint64_t stored_size(const std::string& path);
+uint64_t measure_directory(const std::string& directory);
+void mark_chunks(const std::string& directory, std::unordered_set<std::string>& live);
+std::vector<std::string> load_usernames();
 void set_data_port(const std::string& port_command, int &data_port, std::string &client_ip);
 void enable_passive_mode(int client_socket, int  &passive_socket, int &data_port);
 bool validate_username(const std::string& username);
@@ -35,12 +62,60 @@ std::string hash_password(const std::string& password);
 std::string current_type = "A";
 int default_data_port = PORT - 1;
 std::mutex client_mutex;
+std::unique_ptr<Vfs> vfs; // Storage backend for ftp_root, chosen with FTP_VFS
+std::unique_ptr<ChunkStore> chunk_store; // Set when FTP_CHUNK_STORE enables deduplicated storage
+std::shared_mutex chunk_gc_mutex; // Shared while chunk references are made or followed, exclusive during SITE GC
+std::unique_ptr<QuotaIndex> quota_index;
+std::unique_ptr<EventQueue> event_queue; // Set when FTP_EVENT_SOCKET enables change notifications
+
+// Thrown out of a RETR when the client sends ABOR during the transfer.
+struct TransferAborted : std::runtime_error {
+    TransferAborted() : std::runtime_error("Transfer aborted by client") {}
+};
 
 int main() {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
 
+    if (std::getenv("FTP_TRACE") != nullptr) {
+        trace_enabled = true;
+    }
+    trace_start_signal_dumper(TRACE_FILE);
+
+    const char* vfs_backend = std::getenv("FTP_VFS");
+    vfs = make_vfs(vfs_backend ? vfs_backend : "posix");
+    if (!vfs) {
+        std::cerr << "Error: Unknown FTP_VFS backend " << vfs_backend << " (expected posix, memory or direct)" << std::endl;
+        return 1;
+    }
+    std::cout << "Using " << vfs->name() << " storage backend." << std::endl;
+
+    if (const char* chunk_root = std::getenv("FTP_CHUNK_STORE")) {
+        chunk_store = std::make_unique<ChunkStore>(chunk_root);
+        std::cout << "Deduplicating uploads into " << chunk_root << "." << std::endl;
+    }
+
+    // Usage is only persisted for backends whose files outlive the process;
+    // otherwise the index stays in memory and starts from a measurement.
+    bool persistent = vfs->is_persistent();
+    quota_index = std::make_unique<QuotaIndex>(persistent ? QUOTA_SNAPSHOT : "", persistent ? QUOTA_JOURNAL : "");
+    quota_index->load_limits(QUOTA_LIMITS);
+    if (!quota_index->load()) {
+        quota_index->rebuild(load_usernames(), [](const std::string& user) {
+            return measure_directory("ftp_root/" + user);
+        });
+    }
+    quota_index->compact();
+
+    if (const char* event_socket = std::getenv("FTP_EVENT_SOCKET")) {
+        event_queue = std::make_unique<EventQueue>();
+        if (!event_start_socket_server(*event_queue, event_socket)) {
+            return 1;
+        }
+        std::cout << "Publishing file events on " << event_socket << "." << std::endl;
+    }
+
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == -1) {
         perror("Error: Unable to create socket");
@@ -142,13 +217,19 @@ void handle_client(int client_socket) {
     std::string client_ip = "";
     std::string current_username;
     std::string user_directory;
+    std::string rename_from;
+    std::string copy_from;
     bool is_authenticated = false;
 
+    trace_set_thread_name("client " + std::to_string(client_socket));
+    TraceSpan session_span("session", "", true);
+
     try {
         send_response(client_socket, "220 Welcome to the FTP server\r\n");
 
         while (true) {
             std::string command = receive_command(client_socket);
+            TraceSpan command_span("command", command.substr(0, 4));
             if (command.empty()) {
                 std::cout << "Client disconnected." << std::endl;
                 close(client_socket);
@@ -204,6 +285,36 @@ void handle_client(int client_socket) {
             else if (!is_authenticated) {
                 send_response(client_socket, "530 Not logged in.\r\n");
             }
+            else if (command.substr(0, 4) == "SITE") {
+                handle_site_command(client_socket, command.size() > 5 ? command.substr(5) : "", user_directory, copy_from, current_username);
+            }
+            else if (command.substr(0, 4) == "RNFR") {
+                rename_from = command.size() > 5 ? command.substr(5) : "";
+                VfsEntry entry;
+                if (!validate_filename(rename_from)) {
+                    send_response(client_socket, "553 File name not allowed.\r\n");
+                    rename_from.clear();
+                } else if (vfs->stat(user_directory + "/" + rename_from, entry)) {
+                    send_response(client_socket, "350 Ready for RNTO.\r\n");
+                } else {
+                    send_response(client_socket, "550 File not found.\r\n");
+                    rename_from.clear();
+                }
+            }
+            else if (command.substr(0, 4) == "RNTO") {
+                if (rename_from.empty()) {
+                    send_response(client_socket, "503 RNFR required first.\r\n");
+                    continue;
+                }
+                handle_rename_command(client_socket, user_directory, rename_from, command.size() > 5 ? command.substr(5) : "", current_username);
+                rename_from.clear();
+            }
+            else if (command.substr(0, 4) == "ABOR") {
+                send_response(client_socket, "225 No transfer to abort.\r\n");
+            }
+            else if (command.substr(0, 4) == "DELE") {
+                handle_dele_command(client_socket, user_directory, command.size() > 5 ? command.substr(5) : "", current_username);
+            }
             else if (command.substr(0, 4) == "TYPE") {
                 std::string type = command.substr(5);
                 if (type == "A") {
@@ -226,13 +337,13 @@ void handle_client(int client_socket) {
                 is_passive = true;
             }
             else if (command.substr(0, 4) == "LIST") {
-                handle_data_connection(client_socket, "LIST", data_port, is_passive, client_ip, passive_socket, user_directory);
+                handle_data_connection(client_socket, "LIST", data_port, is_passive, client_ip, passive_socket, user_directory, current_username);
             }
             else if (command.substr(0, 4) == "RETR") {
-                handle_data_connection(client_socket, command, data_port, is_passive, client_ip, passive_socket, user_directory);
+                handle_data_connection(client_socket, command, data_port, is_passive, client_ip, passive_socket, user_directory, current_username);
             }
             else if (command.substr(0, 4) == "STOR") {
-                handle_data_connection(client_socket, command, data_port, is_passive, client_ip, passive_socket, user_directory);
+                handle_data_connection(client_socket, command, data_port, is_passive, client_ip, passive_socket, user_directory, current_username);
             }
             else {
                 send_response(client_socket, "502 Command not implemented.\r\n");
@@ -249,7 +360,7 @@ void handle_client(int client_socket) {
 
 void handle_help_command(int client_socket, const std::string& command) {
     if (command.empty()) {
-        send_response(client_socket, "214 Supported commands: USER, PASS, TYPE, PORT, PASV, LIST, RETR, STOR, HELP, QUIT\r\n");
+        send_response(client_socket, "214 Supported commands: USER, PASS, TYPE, PORT, PASV, LIST, RETR, STOR, ABOR, DELE, RNFR, RNTO, SITE, HELP, QUIT\r\n");
     } else {
         if (command == "USER") {
             send_response(client_socket, "214 USER: Specify username to login.\r\n");
@@ -267,6 +378,16 @@ void handle_help_command(int client_socket, const std::string& command) {
             send_response(client_socket, "214 RETR: Retrieve file from server.\r\n");
         } else if (command == "STOR") {
             send_response(client_socket, "214 STOR: Store file on server.\r\n");
+        } else if (command == "ABOR") {
+            send_response(client_socket, "214 ABOR: Cancel a transfer waiting for its passive data connection.\r\n");
+        } else if (command == "DELE") {
+            send_response(client_socket, "214 DELE: Delete a file.\r\n");
+        } else if (command == "RNFR") {
+            send_response(client_socket, "214 RNFR: Specify file to rename.\r\n");
+        } else if (command == "RNTO") {
+            send_response(client_socket, "214 RNTO: Specify new name after RNFR.\r\n");
+        } else if (command == "SITE") {
+            send_response(client_socket, "214 SITE: TRACE [ON|OFF] dumps or toggles tracing; CPFR/CPTO copy a file on the server; QUOTA shows storage usage; GC frees unreferenced chunks.\r\n");
         } else if (command == "QUIT") {
             send_response(client_socket, "214 QUIT: Close the connection.\r\n");
         } else {
@@ -275,6 +396,165 @@ void handle_help_command(int client_socket, const std::string& command) {
     }
 }
 
+void handle_site_command(int client_socket, const std::string& arguments, const std::string& user_directory, std::string& copy_from, const std::string& username) {
+    size_t split = arguments.find(' ');
+    std::string subcommand = arguments.substr(0, split);
+    std::string parameter = split == std::string::npos ? "" : arguments.substr(split + 1);
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+
+    if (subcommand == "TRACE") {
+        std::string option = parameter;
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option == "ON") {
+            trace_enabled = true;
+            send_response(client_socket, "200 Tracing enabled.\r\n");
+        } else if (option == "OFF") {
+            trace_enabled = false;
+            send_response(client_socket, "200 Tracing disabled.\r\n");
+        } else if (option.empty()) {
+            size_t event_count = 0;
+            if (trace_dump(TRACE_FILE, event_count)) {
+                send_response(client_socket, "200 Trace written to " TRACE_FILE " (" + std::to_string(event_count) + " events).\r\n");
+            } else {
+                send_response(client_socket, "451 Failed to write trace.\r\n");
+            }
+        } else {
+            send_response(client_socket, "501 Usage: SITE TRACE [ON|OFF].\r\n");
+        }
+    } else if (subcommand == "CPFR") {
+        VfsEntry entry;
+        if (!validate_filename(parameter)) {
+            copy_from.clear();
+            send_response(client_socket, "553 File name not allowed.\r\n");
+        } else if (vfs->stat(user_directory + "/" + parameter, entry) && !entry.is_directory) {
+            copy_from = parameter;
+            send_response(client_socket, "350 Ready for SITE CPTO.\r\n");
+        } else {
+            copy_from.clear();
+            send_response(client_socket, "550 File not found.\r\n");
+        }
+    } else if (subcommand == "CPTO") {
+        if (copy_from.empty()) {
+            send_response(client_socket, "503 SITE CPFR required first.\r\n");
+        } else if (parameter.empty()) {
+            send_response(client_socket, "501 Usage: SITE CPTO <filename>.\r\n");
+        } else if (!validate_filename(parameter)) {
+            send_response(client_socket, "553 File name not allowed.\r\n");
+        } else {
+            TraceSpan copy_span("copy", copy_from);
+            std::string source = user_directory + "/" + copy_from;
+            std::string destination = user_directory + "/" + parameter;
+            int64_t delta = static_cast<int64_t>(stored_size(source)) - static_cast<int64_t>(stored_size(destination));
+            uint64_t reserved = delta > 0 ? delta : 0;
+            std::shared_lock<std::shared_mutex> gc_lock(chunk_gc_mutex);
+            if (!quota_index->reserve(username, reserved)) {
+                send_response(client_socket, "552 Quota exceeded.\r\n");
+            } else if (vfs->copy(source, destination)) {
+                quota_index->apply(username, delta, reserved);
+                if (event_queue) {
+                    event_queue->publish("COPY", username, parameter, stored_size(destination), copy_from);
+                }
+                send_response(client_socket, "250 Copy successful.\r\n");
+            } else {
+                quota_index->release(username, reserved);
+                send_response(client_socket, "550 Copy failed.\r\n");
+            }
+            copy_from.clear();
+        }
+    } else if (subcommand == "QUOTA") {
+        uint64_t used = quota_index->usage(username);
+        uint64_t limit = quota_index->limit(username);
+        if (limit == 0) {
+            send_response(client_socket, "200 Quota: " + std::to_string(used) + " bytes used, no limit.\r\n");
+        } else {
+            send_response(client_socket, "200 Quota: " + std::to_string(used) + " of " + std::to_string(limit) + " bytes used.\r\n");
+        }
+    } else if (subcommand == "GC") {
+        if (!chunk_store) {
+            send_response(client_socket, "502 Chunk store not enabled.\r\n");
+            return;
+        }
+        // The store outlives a non-persistent ftp_root and may hold chunks
+        // that manifests on disk still use, which this scan cannot see.
+        if (!vfs->is_persistent()) {
+            send_response(client_socket, "502 SITE GC needs a persistent storage backend.\r\n");
+            return;
+        }
+        TraceSpan gc_span("gc");
+        try {
+            // Waits for running uploads, renames and copies, so every live
+            // chunk is named by a manifest while ftp_root is scanned.
+            std::unique_lock<std::shared_mutex> gc_lock(chunk_gc_mutex);
+            std::unordered_set<std::string> live;
+            mark_chunks("ftp_root", live);
+            uint64_t freed_bytes = 0;
+            size_t removed = chunk_store->sweep(live, freed_bytes);
+            send_response(client_socket, "200 Removed " + std::to_string(removed) + " unreferenced chunk files (" + std::to_string(freed_bytes) + " bytes).\r\n");
+        } catch (const std::exception& e) {
+            std::cerr << "Error during chunk GC: " << e.what() << std::endl;
+            send_response(client_socket, "451 Garbage collection failed.\r\n");
+        }
+    } else {
+        send_response(client_socket, "504 Unknown SITE command.\r\n");
+    }
+}
+
+void handle_rename_command(int client_socket, const std::string& user_directory, const std::string& rename_from, const std::string& rename_to, const std::string& username) {
+    if (rename_to.empty()) {
+        send_response(client_socket, "501 Usage: RNTO <filename>.\r\n");
+        return;
+    }
+    if (!validate_filename(rename_to)) {
+        send_response(client_socket, "553 File name not allowed.\r\n");
+        return;
+    }
+    // Names cannot contain '/', so equal names are the same file.
+    if (rename_to == rename_from) {
+        send_response(client_socket, "250 Rename successful.\r\n");
+        return;
+    }
+
+    // Renaming over an existing file frees that file's space.
+    std::string destination = user_directory + "/" + rename_to;
+    uint64_t replaced_size = stored_size(destination);
+    std::shared_lock<std::shared_mutex> gc_lock(chunk_gc_mutex);
+
+    if (!vfs->rename(user_directory + "/" + rename_from, destination)) {
+        send_response(client_socket, "550 Rename failed.\r\n");
+        return;
+    }
+    quota_index->apply(username, -static_cast<int64_t>(replaced_size));
+    if (event_queue) {
+        event_queue->publish("RENAME", username, rename_to, stored_size(destination), rename_from);
+    }
+    send_response(client_socket, "250 Rename successful.\r\n");
+}
+
+void handle_dele_command(int client_socket, const std::string& user_directory, const std::string& filename, const std::string& username) {
+    if (!validate_filename(filename)) {
+        send_response(client_socket, "553 File name not allowed.\r\n");
+        return;
+    }
+
+    std::string filepath = user_directory + "/" + filename;
+    VfsEntry entry;
+    if (!vfs->stat(filepath, entry) || entry.is_directory) {
+        send_response(client_socket, "550 File not found.\r\n");
+        return;
+    }
+
+    uint64_t size = stored_size(filepath);
+    if (!vfs->remove(filepath)) {
+        send_response(client_socket, "550 Delete failed.\r\n");
+        return;
+    }
+    quota_index->apply(username, -static_cast<int64_t>(size));
+    if (event_queue) {
+        event_queue->publish("DELE", username, filename, 0);
+    }
+    send_response(client_socket, "250 File deleted.\r\n");
+}
+
 void enable_passive_mode(int client_socket, int &passive_socket, int &data_port) {
     try {
         if (passive_socket != -1) {
@@ -341,10 +621,42 @@ void enable_passive_mode(int client_socket, int &passive_socket, int &data_port)
     }
 }
 
-void handle_data_connection(int client_socket, const std::string& command, int data_port, bool is_passive, const std::string& client_ip, int passive_socket, const std::string& user_directory) {
+void handle_data_connection(int client_socket, const std::string& command, int data_port, bool is_passive, const std::string& client_ip, int passive_socket, const std::string& user_directory, const std::string& username) {
     try {
+        TraceSpan data_span("data_connection", command.substr(0, 4));
+
+        // Refuse a missing file before connecting: as an FXP source, opening
+        // the connection would complete the destination's STOR with an
+        // empty file.
+        VfsEntry entry;
+        if (command != "LIST" && !validate_filename(command.size() > 5 ? command.substr(5) : "")) {
+            send_response(client_socket, "553 File name not allowed.\r\n");
+            return;
+        }
+        if (command.substr(0, 4) == "RETR" && !vfs->stat(user_directory + "/" + command.substr(5), entry)) {
+            send_response(client_socket, "550 File not found.\r\n");
+            return;
+        }
+
         int data_socket;
         if (is_passive) {
+            TraceSpan accept_span("accept");
+            // Watch the control connection too, so a client (for example
+            // an FXP controller whose source refused) can ABOR a transfer
+            // nobody will ever connect for.
+            struct pollfd fds[2] = {{passive_socket, POLLIN, 0}, {client_socket, POLLIN, 0}};
+            while (poll(fds, 2, -1) > 0 && !(fds[0].revents & POLLIN)) {
+                std::string pending = receive_command(client_socket);
+                if (pending.empty()) {
+                    return;
+                }
+                if (pending.substr(0, 4) == "ABOR") {
+                    send_response(client_socket, "426 Connection closed; transfer aborted.\r\n");
+                    send_response(client_socket, "226 Abort successful.\r\n");
+                    return;
+                }
+                send_response(client_socket, "503 Waiting for data connection; send ABOR to cancel.\r\n");
+            }
             struct sockaddr_in client_addr;
             socklen_t client_len = sizeof(client_addr);
             data_socket = accept(passive_socket, (struct sockaddr*)&client_addr, &client_len);
@@ -354,6 +666,7 @@ void handle_data_connection(int client_socket, const std::string& command, int d
                 return;
             }
         } else {
+            TraceSpan connect_span("connect");
             data_socket = socket(AF_INET, SOCK_STREAM, 0);
             if (data_socket == -1) {
                 perror("Error: Unable to create active data socket");
@@ -379,7 +692,7 @@ void handle_data_connection(int client_socket, const std::string& command, int d
         } else if (command.substr(0, 4) == "RETR") {
             handle_retr_command(data_socket, user_directory, command.substr(5), client_socket);
         } else if (command.substr(0, 4) == "STOR") {
-            handle_stor_command(data_socket, user_directory, command.substr(5), client_socket);
+            handle_stor_command(data_socket, user_directory, command.substr(5), client_socket, username);
         }
 
         close(data_socket);
@@ -391,12 +704,20 @@ void handle_data_connection(int client_socket, const std::string& command, int d
 
 void handle_list_command(int data_socket, const std::string& user_directory, int client_socket) {
     try {
+        TraceSpan list_span("LIST", user_directory);
         std::ostringstream list;
-        for (const auto& entry : fs::directory_iterator(user_directory)) {
-            list << entry.path().filename().string() << "\r\n";
+        {
+            TraceSpan walk_span("directory_walk");
+            for (const VfsEntry& entry : vfs->list(user_directory)) {
+                list << entry.name << "\r\n";
+            }
         }
         std::string response = list.str();
-        send(data_socket, response.c_str(), response.size(), 0);
+        {
+            TraceSpan send_span("send");
+            send_span.add_bytes(response.size());
+            send(data_socket, response.c_str(), response.size(), 0);
+        }
         send_response(client_socket, "226 Directory send OK.\r\n");
     } catch (const std::exception& e) {
         send_response(client_socket, "451 Requested action aborted: Failed to list directory.\r\n");
@@ -406,69 +727,306 @@ void handle_list_command(int data_socket, const std::string& user_directory, int
 
 void handle_retr_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket) {
     try {
+        TraceSpan retr_span("RETR", filename);
         std::string filepath = user_directory + "/" + filename;
-        std::ifstream file(filepath, current_type == "A" ? std::ios::in : std::ios::binary);
+        std::unique_ptr<VfsFile> file;
+        {
+            TraceSpan open_span("file_open");
+            file = vfs->open_read(filepath);
+        }
         if (!file) {
             send_response(client_socket, "550 File not found.\r\n");
             return;
         }
 
+        char buffer[BUFFER_SIZE];
+        size_t bytes_read;
+        {
+            TraceSpan read_span("disk_read");
+            bytes_read = file->read(buffer, sizeof(buffer));
+        }
+
+        std::vector<ChunkRef> chunks;
+        if (chunk_store && read_manifest(*file, buffer, bytes_read, chunks)) {
+            send_response(client_socket, "150 Opening data connection.\r\n");
+            std::shared_lock<std::shared_mutex> gc_lock(chunk_gc_mutex);
+            send_chunks(data_socket, chunks, client_socket);
+            send_response(client_socket, "226 Transfer complete.\r\n");
+            return;
+        }
+
         send_response(client_socket, "150 Opening data connection.\r\n");
 
-        char buffer[BUFFER_SIZE];
-        if (current_type == "A") {
-            std::string line;
-            while (std::getline(file, line)) {
-                line += "\r\n";
-                send(data_socket, line.c_str(), line.size(), 0);
-            }
-        } else {
-            while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
-                send(data_socket, buffer, file.gcount(), 0);
-            }
+        while (bytes_read > 0) {
+            send_data(data_socket, buffer, bytes_read, client_socket);
+            TraceSpan read_span("disk_read");
+            bytes_read = file->read(buffer, sizeof(buffer));
         }
 
         send_response(client_socket, "226 Transfer complete.\r\n");
+    } catch (const TransferAborted&) {
+        send_response(client_socket, "426 Connection closed; transfer aborted.\r\n");
+        send_response(client_socket, "226 Abort successful.\r\n");
     } catch (const std::exception& e) {
         send_response(client_socket, "451 Requested action aborted: Failed to retrieve file.\r\n");
         std::cerr << "Error during RETR: " << e.what() << std::endl;
     }
 }
 
-void handle_stor_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket) {
+// Uploads are written under a temporary name next to the target and renamed
+// over it only once complete, so a refused or failed STOR leaves the user's
+// existing file as it was.
+void handle_stor_command(int data_socket, const std::string& user_directory, const std::string& filename, int client_socket, const std::string& username) {
+    static std::atomic<uint64_t> upload_counter{0};
+    std::string filepath = user_directory + "/" + filename;
+    std::string temp_path = user_directory + "/." + filename + ".upload-" + std::to_string(upload_counter++);
+    int64_t replaced_size = 0;
+    int64_t received = 0;
+    uint64_t reserved = 0;
+    bool file_opened = false;
+    bool replaced = false;
+
     try {
-        std::string filepath = user_directory + "/" + filename;
+        TraceSpan stor_span("STOR", filename);
 
-        std::ofstream file(filepath, current_type == "A" ? std::ios::out : std::ios::binary);
-        if (!file.is_open()) {
+        // Overwriting a file gives its space back, so quota checks are made
+        // against usage without it.
+        replaced_size = stored_size(filepath);
+        if (!quota_index->allows(username, -replaced_size)) {
+            send_response(client_socket, "552 Quota exceeded.\r\n");
+            return;
+        }
+
+        std::unique_ptr<VfsFile> file;
+        {
+            TraceSpan open_span("file_open");
+            file = vfs->open_write(temp_path);
+        }
+        if (!file) {
             send_response(client_socket, "550 Cannot create file.\r\n");
             return;
         }
+        file_opened = true;
 
         send_response(client_socket, "150 Opening data connection.\r\n");
 
+        // Chunks stored or matched here are only referenced once the
+        // manifest is written, so SITE GC must wait for this upload.
+        std::unique_ptr<ChunkUpload> upload;
+        std::shared_lock<std::shared_mutex> gc_lock(chunk_gc_mutex, std::defer_lock);
+        if (chunk_store) {
+            gc_lock.lock();
+            upload = std::make_unique<ChunkUpload>(*chunk_store);
+        }
+
         char buffer[BUFFER_SIZE];
         int bytes_read;
+        bool over_quota = false;
 
-        while ((bytes_read = recv(data_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-            file.write(buffer, bytes_read); 
+        while (true) {
+            {
+                TraceSpan recv_span("recv");
+                bytes_read = recv(data_socket, buffer, BUFFER_SIZE, 0);
+                recv_span.add_bytes(bytes_read > 0 ? bytes_read : 0);
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+            // Growth beyond the replaced file is reserved as it arrives, so
+            // parallel uploads by the same user share one limit.
+            received += bytes_read;
+            int64_t growth = received - replaced_size;
+            if (growth > static_cast<int64_t>(reserved)) {
+                if (!quota_index->reserve(username, growth - reserved)) {
+                    over_quota = true;
+                    break;
+                }
+                reserved = growth;
+            }
+            TraceSpan write_span("disk_write");
+            if (upload) {
+                upload->write(buffer, bytes_read);
+            } else {
+                file->write(buffer, bytes_read);
+            }
         }
 
-        if (bytes_read < 0) {
-            perror("Error receiving data");
-            send_response(client_socket, "426 Connection closed; transfer aborted.\r\n");
-        } else {
-            send_response(client_socket, "226 Transfer complete.\r\n");
+        if (over_quota || bytes_read < 0) {
+            file.reset();
+            vfs->remove(temp_path);
+            quota_index->release(username, reserved);
+            if (over_quota) {
+                send_response(client_socket, "552 Quota exceeded; transfer aborted.\r\n");
+            } else {
+                perror("Error receiving data");
+                send_response(client_socket, "426 Connection closed; transfer aborted.\r\n");
+            }
+            return;
         }
 
-        file.close();
+        if (upload) {
+            // The user's file only holds the chunk list.
+            TraceSpan manifest_span("manifest_write");
+            std::string manifest = upload->finish();
+            file->write(manifest.data(), manifest.size());
+            std::cout << "Stored " << filename << ": " << upload->total_bytes() << " bytes, "
+                      << upload->stored_bytes() << " new." << std::endl;
+        }
+
+        {
+            TraceSpan close_span("file_close");
+            file->close();
+        }
+        if (!vfs->rename(temp_path, filepath)) {
+            throw std::runtime_error("Unable to replace " + filepath);
+        }
+        replaced = true;
+        quota_index->apply(username, received - replaced_size, reserved);
+
+        if (event_queue) {
+            event_queue->publish("STOR", username, filename, received);
+        }
+        send_response(client_socket, "226 Transfer complete.\r\n");
     } catch (const std::exception& e) {
         send_response(client_socket, "451 Requested action aborted: Failed to store file.\r\n");
         std::cerr << "Error during STOR: " << e.what() << std::endl;
+
+        // Unless the rename went through, the user's file is untouched and
+        // only the partial upload has to go. If it did, subscribers still
+        // need to hear that the file changed.
+        if (!replaced) {
+            if (file_opened) {
+                vfs->remove(temp_path);
+            }
+            quota_index->release(username, reserved);
+        } else if (event_queue) {
+            event_queue->publish("STOR", username, filename, received);
+        }
     }
 }
 
+bool read_manifest(VfsFile& file, const char* header, size_t header_size, std::vector<ChunkRef>& chunks) {
+    if (!ChunkStore::is_manifest(header, header_size)) {
+        return false;
+    }
 
+    std::string content(header, header_size);
+    char buffer[BUFFER_SIZE];
+    size_t bytes_read;
+    while ((bytes_read = file.read(buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, bytes_read);
+    }
+    if (!ChunkStore::decode_manifest(content, chunks)) {
+        throw std::runtime_error("Corrupt chunk manifest");
+    }
+    return true;
+}
+
+// Sends one block of file data, converting LF to CRLF in ASCII mode.
+// Waits until data_socket can take more data. The control connection is
+// watched meanwhile, so a client can ABOR a transfer whose receiver stopped
+// reading (such as an FXP destination that refused its STOR).
+void wait_writable(int data_socket, int client_socket) {
+    struct pollfd fds[2] = {{data_socket, POLLOUT, 0}, {client_socket, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("poll failed");
+        }
+        if (fds[1].revents) {
+            std::string pending = receive_command(client_socket);
+            if (pending.empty() || pending.substr(0, 4) == "ABOR") {
+                throw TransferAborted();
+            }
+            send_response(client_socket, "503 Transfer in progress; send ABOR to cancel.\r\n");
+        }
+        if (fds[0].revents) {
+            return;
+        }
+    }
+}
+
+void send_data(int data_socket, const char* data, size_t size, int client_socket) {
+    TraceSpan send_span("send");
+    std::string converted;
+    if (current_type == "A") {
+        converted.reserve(size + size / 16);
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] == '\n') {
+                converted += '\r';
+            }
+            converted += data[i];
+        }
+        data = converted.data();
+        size = converted.size();
+    }
+    send_span.add_bytes(size);
+
+    size_t sent = 0;
+    while (sent < size) {
+        wait_writable(data_socket, client_socket);
+        ssize_t result = send(data_socket, data + sent, size - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error("send failed");
+        }
+        sent += result;
+    }
+}
+
+void send_chunks(int data_socket, const std::vector<ChunkRef>& chunks, int client_socket) {
+    for (const ChunkRef& chunk : chunks) {
+        std::string path = chunk_store->chunk_path(chunk.hash);
+        int chunk_fd;
+        {
+            TraceSpan open_span("file_open", chunk.hash);
+            chunk_fd = open(path.c_str(), O_RDONLY);
+        }
+        if (chunk_fd == -1) {
+            throw std::runtime_error("Missing chunk " + chunk.hash);
+        }
+
+        if (current_type == "A") {
+            char buffer[BUFFER_SIZE];
+            ssize_t bytes_read;
+            while (true) {
+                {
+                    TraceSpan read_span("disk_read");
+                    bytes_read = read(chunk_fd, buffer, sizeof(buffer));
+                }
+                if (bytes_read <= 0) {
+                    break;
+                }
+                send_data(data_socket, buffer, bytes_read, client_socket);
+            }
+        } else {
+            // Chunks are sent straight from the page cache. The socket is
+            // non-blocking here so that waiting happens in wait_writable.
+            TraceSpan send_span("sendfile", chunk.hash);
+            off_t offset = 0;
+            while (offset < static_cast<off_t>(chunk.size)) {
+                try {
+                    wait_writable(data_socket, client_socket);
+                } catch (...) {
+                    close(chunk_fd);
+                    throw;
+                }
+                if (sendfile(data_socket, chunk_fd, &offset, chunk.size - offset) <= 0
+                    && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    close(chunk_fd);
+                    throw std::runtime_error("sendfile failed for chunk " + chunk.hash);
+                }
+            }
+            send_span.add_bytes(chunk.size);
+        }
+
+        close(chunk_fd);
+    }
+}
 
 void set_data_port(const std::string& port_command, int &data_port, std::string &client_ip) {
     try {
@@ -537,4 +1095,108 @@ bool validate_input(const std::string& input) {
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+// File arguments name a file directly in the user's directory; anything
+// that could reach another directory is refused.
+bool validate_filename(const std::string& filename) {
+    return !filename.empty() && filename.find('/') == std::string::npos && filename.find("..") == std::string::npos;
+}
+
+// Logical size of a stored file: for chunk manifests, the size of the
+// content they describe. Returns 0 for missing files.
+uint64_t stored_size(const std::string& path) {
+    VfsEntry entry;
+    if (!vfs->stat(path, entry) || entry.is_directory) {
+        return 0;
+    }
+    if (!chunk_store) {
+        return entry.size;
+    }
+
+    std::unique_ptr<VfsFile> file = vfs->open_read(path);
+    if (!file) {
+        return entry.size;
+    }
+    char header[BUFFER_SIZE];
+    size_t header_size = file->read(header, sizeof(header));
+    std::vector<ChunkRef> chunks;
+    try {
+        if (!read_manifest(*file, header, header_size, chunks)) {
+            return entry.size;
+        }
+    } catch (const std::exception&) {
+        // A corrupt manifest describes nothing; charge what is on disk.
+        return entry.size;
+    }
+    uint64_t total = 0;
+    for (const ChunkRef& chunk : chunks) {
+        total += chunk.size;
+    }
+    return total;
+}
+
+uint64_t measure_directory(const std::string& directory) {
+    uint64_t total = 0;
+    VfsEntry entry;
+    if (!vfs->stat(directory, entry)) {
+        return 0;
+    }
+    for (const VfsEntry& child : vfs->list(directory)) {
+        std::string path = directory + "/" + child.name;
+        total += child.is_directory ? measure_directory(path) : stored_size(path);
+    }
+    return total;
+}
+
+// Adds every chunk named by a manifest under directory to live. Files that
+// vanish or turn out not to be valid manifests reference nothing; read
+// errors throw so that a sweep never runs on an incomplete mark.
+void mark_chunks(const std::string& directory, std::unordered_set<std::string>& live) {
+    for (const VfsEntry& child : vfs->list(directory)) {
+        std::string path = directory + "/" + child.name;
+        if (child.is_directory) {
+            mark_chunks(path, live);
+            continue;
+        }
+
+        std::unique_ptr<VfsFile> file = vfs->open_read(path);
+        if (!file) {
+            continue;
+        }
+        char buffer[BUFFER_SIZE];
+        size_t bytes_read = file->read(buffer, sizeof(buffer));
+        if (!ChunkStore::is_manifest(buffer, bytes_read)) {
+            continue;
+        }
+        std::string content(buffer, bytes_read);
+        while ((bytes_read = file->read(buffer, sizeof(buffer))) > 0) {
+            content.append(buffer, bytes_read);
+        }
+        std::vector<ChunkRef> chunks;
+        if (ChunkStore::decode_manifest(content, chunks)) {
+            for (const ChunkRef& chunk : chunks) {
+                live.insert(chunk.hash);
+            }
+        }
+    }
+}
+
+std::vector<std::string> load_usernames() {
+    std::vector<std::string> usernames;
+    std::ifstream file("credentials.txt");
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to open credentials file" << std::endl;
+        return usernames;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream line_stream(line);
+        std::string username;
+        if (line_stream >> username) {
+            usernames.push_back(username);
+        }
+    }
+    return usernames;
+}
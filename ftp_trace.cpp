@@ -0,0 +1,225 @@
+#include "ftp_trace.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_BUFFER_EVENTS 65536
+// Events of finished threads kept for the next dump; the oldest buffers are
+// dropped beyond this so that tracing memory stays bounded without dumps.
+#define TRACE_MAX_EXITED_EVENTS (4 * TRACE_BUFFER_EVENTS)
+
+std::atomic<bool> trace_enabled{false};
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    std::string detail;
+    int64_t bytes;
+};
+
+// One per thread. The owning thread is the only writer; the mutex is only
+// contended while a dump copies the buffer out.
+struct TraceBuffer {
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    size_t next = 0;
+    long tid = 0;
+    std::string thread_name;
+    bool thread_exited = false;
+};
+
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<TraceBuffer>> registry;
+std::mutex dump_mutex;
+
+struct ThreadBufferHandle {
+    std::shared_ptr<TraceBuffer> buffer;
+
+    ~ThreadBufferHandle() {
+        if (buffer) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            buffer->thread_exited = true;
+        }
+    }
+};
+
+thread_local ThreadBufferHandle thread_buffer;
+// Set even while tracing is off, so a thread traced later is still named.
+thread_local std::string thread_name;
+
+// Called with registry_mutex held. Registry order is creation order, so the
+// first exited buffers found are the oldest.
+void prune_exited_buffers() {
+    size_t exited_events = 0;
+    for (const auto& buffer : registry) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        exited_events += buffer->thread_exited ? buffer->events.size() : 0;
+    }
+
+    for (auto it = registry.begin(); it != registry.end() && exited_events > TRACE_MAX_EXITED_EVENTS;) {
+        size_t events = 0;
+        bool thread_exited;
+        {
+            std::lock_guard<std::mutex> lock((*it)->mutex);
+            thread_exited = (*it)->thread_exited;
+            events = (*it)->events.size();
+        }
+        if (thread_exited) {
+            it = registry.erase(it);
+            exited_events -= events;
+        } else {
+            ++it;
+        }
+    }
+}
+
+TraceBuffer& current_buffer() {
+    if (!thread_buffer.buffer) {
+        auto buffer = std::make_shared<TraceBuffer>();
+        buffer->events.reserve(1024);
+        buffer->tid = syscall(SYS_gettid);
+        buffer->thread_name = thread_name.empty() ? "thread " + std::to_string(buffer->tid) : thread_name;
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        prune_exited_buffers();
+        registry.push_back(buffer);
+        thread_buffer.buffer = std::move(buffer);
+    }
+    return *thread_buffer.buffer;
+}
+
+std::string json_escape(const std::string& text) {
+    std::ostringstream out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xf];
+        } else {
+            out << c;
+        }
+    }
+    return out.str();
+}
+
+}
+
+uint64_t trace_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_record(const char* name, uint64_t start_us, uint64_t end_us, const std::string& detail, int64_t bytes) {
+    TraceBuffer& buffer = current_buffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+
+    TraceEvent event{name, start_us, end_us - start_us, detail, bytes};
+    if (buffer.events.size() < TRACE_BUFFER_EVENTS) {
+        buffer.events.push_back(std::move(event));
+    } else {
+        // Ring buffer: overwrite the oldest span.
+        buffer.events[buffer.next] = std::move(event);
+    }
+    buffer.next = (buffer.next + 1) % TRACE_BUFFER_EVENTS;
+}
+
+void trace_set_thread_name(const std::string& name) {
+    thread_name = name;
+    if (thread_buffer.buffer) {
+        std::lock_guard<std::mutex> lock(thread_buffer.buffer->mutex);
+        thread_buffer.buffer->thread_name = name;
+    }
+}
+
+bool trace_dump(const std::string& path, size_t& event_count) {
+    std::lock_guard<std::mutex> dump_lock(dump_mutex);
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffers = registry;
+    }
+
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to open trace file " << path << std::endl;
+        return false;
+    }
+
+    long pid = getpid();
+    bool first = true;
+    event_count = 0;
+
+    file << "{\"traceEvents\":[\n";
+    for (const auto& buffer : buffers) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+
+        file << (first ? "" : ",\n")
+             << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+             << ",\"args\":{\"name\":\"" << json_escape(buffer->thread_name) << "\"}}";
+        first = false;
+
+        for (const TraceEvent& event : buffer->events) {
+            file << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"ftp\",\"ph\":\"X\",\"ts\":" << event.start_us
+                 << ",\"dur\":" << event.duration_us << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid;
+            if (!event.detail.empty() || event.bytes >= 0) {
+                file << ",\"args\":{";
+                if (!event.detail.empty()) {
+                    file << "\"detail\":\"" << json_escape(event.detail) << "\"";
+                }
+                if (event.bytes >= 0) {
+                    file << (event.detail.empty() ? "" : ",") << "\"bytes\":" << event.bytes;
+                }
+                file << "}";
+            }
+            file << "}";
+            ++event_count;
+        }
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    // Buffers of finished client threads have now been written out.
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto it = registry.begin(); it != registry.end();) {
+        std::lock_guard<std::mutex> buffer_lock((*it)->mutex);
+        if ((*it)->thread_exited) {
+            it = registry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return file.good();
+}
+
+void trace_start_signal_dumper(const std::string& path) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::thread dumper([signals, path]() {
+        while (true) {
+            int signal_number;
+            if (sigwait(&signals, &signal_number) != 0) {
+                continue;
+            }
+            size_t event_count = 0;
+            if (trace_dump(path, event_count)) {
+                std::cout << "Trace written to " << path << " (" << event_count << " events)." << std::endl;
+            }
+        }
+    });
+    dumper.detach();
+}
@@ -0,0 +1,60 @@
+#ifndef FTP_TRACE_H
+#define FTP_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Span tracing for the server. Spans are recorded into per-thread ring
+// buffers only while tracing is enabled; when disabled a span costs one
+// relaxed atomic load. trace_dump() writes Chrome trace-event JSON that can
+// be opened in Perfetto or chrome://tracing.
+
+extern std::atomic<bool> trace_enabled;
+
+uint64_t trace_now_us();
+void trace_record(const char* name, uint64_t start_us, uint64_t end_us, const std::string& detail, int64_t bytes);
+void trace_set_thread_name(const std::string& name);
+bool trace_dump(const std::string& path, size_t& event_count);
+
+// Blocks SIGUSR1 in the calling thread (and threads it creates afterwards)
+// and starts a thread that dumps the trace to path whenever SIGUSR1 arrives.
+// Must be called from main() before any other thread is started.
+void trace_start_signal_dumper(const std::string& path);
+
+// A long_lived span (such as a whole session) always reads the clock, so it
+// is still recorded when tracing is switched on while it is open.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, const std::string& detail = "", bool long_lived = false)
+        : name(long_lived || trace_enabled.load(std::memory_order_relaxed) ? name : nullptr), long_lived(long_lived) {
+        if (this->name) {
+            this->detail = detail;
+            start_us = trace_now_us();
+        }
+    }
+
+    ~TraceSpan() {
+        if (name && (!long_lived || trace_enabled.load(std::memory_order_relaxed))) {
+            trace_record(name, start_us, trace_now_us(), detail, bytes);
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void add_bytes(int64_t count) {
+        if (name) {
+            bytes = (bytes < 0 ? 0 : bytes) + count;
+        }
+    }
+
+private:
+    const char* name;
+    bool long_lived;
+    std::string detail;
+    uint64_t start_us = 0;
+    int64_t bytes = -1;
+};
+
+#endif
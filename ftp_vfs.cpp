@@ -0,0 +1,472 @@
+#include "ftp_vfs.h"
+
+#include <iostream>
+#include <filesystem>
+#include <stdexcept>
+#include <map>
+#include <set>
+#include <mutex>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_BUFFER_SIZE (1024 * 1024)
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::runtime_error io_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+class PosixFile : public VfsFile {
+public:
+    explicit PosixFile(int fd) : fd(fd) {}
+
+    ~PosixFile() override {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    size_t read(char* buffer, size_t size) override {
+        ssize_t bytes_read;
+        do {
+            bytes_read = ::read(fd, buffer, size);
+        } while (bytes_read == -1 && errno == EINTR);
+        if (bytes_read == -1) {
+            throw io_error("Read failed");
+        }
+        return bytes_read;
+    }
+
+    void write(const char* data, size_t size) override {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw io_error("Write failed");
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    void close() override {
+        int result = ::close(fd);
+        fd = -1;
+        if (result == -1) {
+            throw io_error("Close failed");
+        }
+    }
+
+protected:
+    int fd;
+};
+
+class PosixVfs : public Vfs {
+public:
+    const char* name() const override { return "posix"; }
+
+    std::unique_ptr<VfsFile> open_read(const std::string& path) override {
+        int fd = open_file(path, O_RDONLY);
+        if (fd == -1) {
+            return nullptr;
+        }
+        return std::make_unique<PosixFile>(fd);
+    }
+
+    std::unique_ptr<VfsFile> open_write(const std::string& path) override {
+        int fd = open_file(path, O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        return std::make_unique<PosixFile>(fd);
+    }
+
+    std::vector<VfsEntry> list(const std::string& directory) override {
+        std::vector<VfsEntry> entries;
+        for (const auto& item : fs::directory_iterator(directory)) {
+            VfsEntry entry;
+            entry.name = item.path().filename().string();
+            entry.is_directory = item.is_directory();
+            entry.size = entry.is_directory ? 0 : item.file_size();
+            entries.push_back(std::move(entry));
+        }
+        return entries;
+    }
+
+    bool stat(const std::string& path, VfsEntry& entry) override {
+        struct stat info;
+        if (::stat(path.c_str(), &info) == -1) {
+            return false;
+        }
+        entry.name = fs::path(path).filename().string();
+        entry.is_directory = S_ISDIR(info.st_mode);
+        entry.size = info.st_size;
+        return true;
+    }
+
+    bool rename(const std::string& from, const std::string& to) override {
+        if (::rename(from.c_str(), to.c_str()) == -1) {
+            perror("Error: Rename failed");
+            return false;
+        }
+        return true;
+    }
+
+    // Copies without moving data through user space: a reflink shares
+    // extents on filesystems that support it (XFS, btrfs), otherwise
+    // copy_file_range lets the kernel copy (or offload) the range.
+    // read/write is the last resort. The copy is written to a temporary
+    // file and renamed into place, so a failed copy leaves the destination
+    // untouched.
+    bool copy(const std::string& from, const std::string& to) override {
+        int source_fd = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (source_fd == -1) {
+            perror("Error: Unable to open copy source");
+            return false;
+        }
+
+        struct stat source_info, destination_info;
+        if (fstat(source_fd, &source_info) == -1
+            || (::stat(to.c_str(), &destination_info) == 0
+                && source_info.st_dev == destination_info.st_dev && source_info.st_ino == destination_info.st_ino)) {
+            std::cerr << "Error: Copy source and destination are the same file" << std::endl;
+            ::close(source_fd);
+            return false;
+        }
+
+        std::string temp_path = to + ".XXXXXX";
+        int destination_fd = mkostemp(&temp_path[0], O_CLOEXEC);
+        if (destination_fd == -1) {
+            perror("Error: Unable to open copy destination");
+            ::close(source_fd);
+            return false;
+        }
+        fchmod(destination_fd, 0644);
+
+        bool copied = ioctl(destination_fd, FICLONE, source_fd) == 0;
+
+        if (!copied) {
+            copied = true;
+            ssize_t bytes_copied;
+            do {
+                bytes_copied = copy_file_range(source_fd, nullptr, destination_fd, nullptr, 1 << 30, 0);
+            } while (bytes_copied > 0);
+
+            if (bytes_copied == -1) {
+                if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                    perror("Error: copy_file_range failed");
+                    copied = false;
+                } else {
+                    char buffer[64 * 1024];
+                    ssize_t bytes_read;
+                    lseek(source_fd, 0, SEEK_SET);
+                    lseek(destination_fd, 0, SEEK_SET);
+                    copied = ftruncate(destination_fd, 0) == 0;
+                    while (copied && (bytes_read = ::read(source_fd, buffer, sizeof(buffer))) > 0) {
+                        copied = ::write(destination_fd, buffer, bytes_read) == bytes_read;
+                    }
+                    if (!copied || bytes_read == -1) {
+                        perror("Error: Copy failed");
+                        copied = false;
+                    }
+                }
+            }
+        }
+
+        ::close(source_fd);
+        ::close(destination_fd);
+        if (copied && ::rename(temp_path.c_str(), to.c_str()) == -1) {
+            perror("Error: Unable to move copy into place");
+            copied = false;
+        }
+        if (!copied) {
+            ::unlink(temp_path.c_str());
+        }
+        return copied;
+    }
+
+    bool remove(const std::string& path) override {
+        if (::unlink(path.c_str()) == -1) {
+            perror("Error: Remove failed");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static int open_file(const std::string& path, int flags) {
+        return ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    }
+};
+
+// Reads and writes go through one page-aligned buffer so every O_DIRECT
+// transfer has aligned address, offset and length. The final partial block
+// of a written file is padded for the write and trimmed with ftruncate.
+class DirectFile : public PosixFile {
+public:
+    DirectFile(int fd, bool is_direct) : PosixFile(fd), is_direct(is_direct) {
+        if (posix_memalign(reinterpret_cast<void**>(&buffer), DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~DirectFile() override {
+        free(buffer);
+    }
+
+    size_t read(char* out, size_t size) override {
+        if (position == filled) {
+            filled = PosixFile::read(buffer, DIRECT_IO_BUFFER_SIZE);
+            position = 0;
+        }
+        size_t count = std::min(size, filled - position);
+        std::memcpy(out, buffer + position, count);
+        position += count;
+        return count;
+    }
+
+    void write(const char* data, size_t size) override {
+        while (size > 0) {
+            size_t count = std::min(size, DIRECT_IO_BUFFER_SIZE - filled);
+            std::memcpy(buffer + filled, data, count);
+            filled += count;
+            data += count;
+            size -= count;
+            if (filled == DIRECT_IO_BUFFER_SIZE) {
+                PosixFile::write(buffer, filled);
+                written += filled;
+                filled = 0;
+            }
+        }
+    }
+
+    void close() override {
+        if (filled > 0) {
+            size_t padded = is_direct ? (filled + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT : filled;
+            std::memset(buffer + filled, 0, padded - filled);
+            PosixFile::write(buffer, padded);
+            written += filled;
+            filled = 0;
+            if (is_direct && ftruncate(fd, written) == -1) {
+                throw io_error("Truncate failed");
+            }
+        }
+        PosixFile::close();
+    }
+
+private:
+    char* buffer = nullptr;
+    size_t filled = 0;
+    size_t position = 0;
+    uint64_t written = 0;
+    bool is_direct;
+};
+
+class DirectVfs : public PosixVfs {
+public:
+    const char* name() const override { return "direct"; }
+
+    std::unique_ptr<VfsFile> open_read(const std::string& path) override {
+        bool is_direct;
+        int fd = open_direct(path, O_RDONLY, is_direct);
+        if (fd == -1) {
+            return nullptr;
+        }
+        return std::make_unique<DirectFile>(fd, is_direct);
+    }
+
+    std::unique_ptr<VfsFile> open_write(const std::string& path) override {
+        bool is_direct;
+        int fd = open_direct(path, O_WRONLY | O_CREAT | O_TRUNC, is_direct);
+        if (fd == -1) {
+            return nullptr;
+        }
+        return std::make_unique<DirectFile>(fd, is_direct);
+    }
+
+private:
+    // Some filesystems (tmpfs among them) reject O_DIRECT; fall back to
+    // buffered I/O there rather than failing the transfer.
+    int open_direct(const std::string& path, int flags, bool& is_direct) {
+        int fd = ::open(path.c_str(), flags | O_DIRECT | O_CLOEXEC, 0644);
+        is_direct = fd != -1;
+        if (fd == -1 && errno == EINVAL) {
+            fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        }
+        return fd;
+    }
+};
+
+class MemoryVfs;
+
+class MemoryReadFile : public VfsFile {
+public:
+    explicit MemoryReadFile(std::shared_ptr<const std::string> content) : content(std::move(content)) {}
+
+    size_t read(char* buffer, size_t size) override {
+        size_t count = std::min(size, content->size() - position);
+        std::memcpy(buffer, content->data() + position, count);
+        position += count;
+        return count;
+    }
+
+    void write(const char*, size_t) override {
+        throw std::runtime_error("File is open for reading");
+    }
+
+    void close() override {}
+
+private:
+    std::shared_ptr<const std::string> content;
+    size_t position = 0;
+};
+
+class MemoryWriteFile : public VfsFile {
+public:
+    MemoryWriteFile(MemoryVfs& vfs, const std::string& path) : vfs(vfs), path(path) {}
+
+    size_t read(char*, size_t) override {
+        throw std::runtime_error("File is open for writing");
+    }
+
+    void write(const char* data, size_t size) override {
+        content.append(data, size);
+    }
+
+    void close() override;
+
+private:
+    MemoryVfs& vfs;
+    std::string path;
+    std::string content;
+};
+
+// Files are immutable snapshots: readers keep the version they opened and a
+// writer publishes its content on close.
+class MemoryVfs : public Vfs {
+public:
+    const char* name() const override { return "memory"; }
+
+    std::unique_ptr<VfsFile> open_read(const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(path);
+        if (it == files.end()) {
+            return nullptr;
+        }
+        return std::make_unique<MemoryReadFile>(it->second);
+    }
+
+    // Any existing content stays visible until the writer closes, and stays
+    // in place if it never does.
+    std::unique_ptr<VfsFile> open_write(const std::string& path) override {
+        return std::make_unique<MemoryWriteFile>(*this, path);
+    }
+
+    std::vector<VfsEntry> list(const std::string& directory) override {
+        std::string prefix = directory + "/";
+        std::vector<VfsEntry> entries;
+        std::set<std::string> directories;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = files.lower_bound(prefix); it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            std::string rest = it->first.substr(prefix.size());
+            size_t slash = rest.find('/');
+            if (slash == std::string::npos) {
+                entries.push_back({rest, false, it->second->size()});
+            } else if (directories.insert(rest.substr(0, slash)).second) {
+                entries.push_back({rest.substr(0, slash), true, 0});
+            }
+        }
+        return entries;
+    }
+
+    bool stat(const std::string& path, VfsEntry& entry) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.name = fs::path(path).filename().string();
+        auto it = files.find(path);
+        if (it != files.end()) {
+            entry.is_directory = false;
+            entry.size = it->second->size();
+            return true;
+        }
+        auto child = files.lower_bound(path + "/");
+        if (child != files.end() && child->first.compare(0, path.size() + 1, path + "/") == 0) {
+            entry.is_directory = true;
+            entry.size = 0;
+            return true;
+        }
+        return false;
+    }
+
+    bool rename(const std::string& from, const std::string& to) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(from);
+        if (it == files.end()) {
+            return false;
+        }
+        if (from == to) {
+            return true;
+        }
+        files[to] = it->second;
+        files.erase(it);
+        return true;
+    }
+
+    bool copy(const std::string& from, const std::string& to) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(from);
+        if (it == files.end()) {
+            return false;
+        }
+        files[to] = it->second;
+        return true;
+    }
+
+    bool remove(const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return files.erase(path) > 0;
+    }
+
+    bool is_persistent() const override { return false; }
+
+    void publish(const std::string& path, std::string content) {
+        auto snapshot = std::make_shared<const std::string>(std::move(content));
+        std::lock_guard<std::mutex> lock(mutex);
+        files[path] = std::move(snapshot);
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const std::string>> files;
+};
+
+void MemoryWriteFile::close() {
+    vfs.publish(path, std::move(content));
+}
+
+}
+
+std::unique_ptr<Vfs> make_vfs(const std::string& backend) {
+    if (backend == "posix") {
+        return std::make_unique<PosixVfs>();
+    }
+    if (backend == "memory") {
+        return std::make_unique<MemoryVfs>();
+    }
+    if (backend == "direct") {
+        return std::make_unique<DirectVfs>();
+    }
+    return nullptr;
+}
@@ -0,0 +1,54 @@
+#ifndef FTP_VFS_H
+#define FTP_VFS_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Virtual filesystem used by the server for everything under ftp_root.
+// Backends:
+//   posix  - regular files through open/read/write (default)
+//   memory - files kept in RAM, for measuring protocol overhead without disk
+//   direct - O_DIRECT with page-aligned buffers, bypassing the page cache
+// Paths are the same strings the server always used (ftp_root/<user>/<file>).
+
+struct VfsEntry {
+    std::string name;
+    bool is_directory = false;
+    uint64_t size = 0;
+};
+
+class VfsFile {
+public:
+    virtual ~VfsFile() = default;
+
+    // Returns 0 at end of file. Errors throw std::runtime_error.
+    virtual size_t read(char* buffer, size_t size) = 0;
+    virtual void write(const char* data, size_t size) = 0;
+    // Flushes and closes; a file opened for writing is only guaranteed to be
+    // complete once close() returned without throwing.
+    virtual void close() = 0;
+};
+
+class Vfs {
+public:
+    virtual ~Vfs() = default;
+
+    virtual const char* name() const = 0;
+    // Both return nullptr when the file cannot be opened.
+    virtual std::unique_ptr<VfsFile> open_read(const std::string& path) = 0;
+    virtual std::unique_ptr<VfsFile> open_write(const std::string& path) = 0;
+    virtual std::vector<VfsEntry> list(const std::string& directory) = 0;
+    virtual bool stat(const std::string& path, VfsEntry& entry) = 0;
+    virtual bool rename(const std::string& from, const std::string& to) = 0;
+    virtual bool copy(const std::string& from, const std::string& to) = 0;
+    virtual bool remove(const std::string& path) = 0;
+    // False when contents do not survive a restart.
+    virtual bool is_persistent() const { return true; }
+};
+
+// Returns nullptr for an unknown backend name.
+std::unique_ptr<Vfs> make_vfs(const std::string& backend);
+
+#endif